@@ -13,6 +13,20 @@
 // Pointer for our SerialDevicePeripheral that we will instantiate / initialize later
 rw::serial_device::SerialDevicePeripheral *myDevice;
 
+// Called by update() whenever a packet arrives with "cmd" set to "led"
+void ledCommand(rw::serial_device::SerialDevicePeripheral &device, rw::mdt::MixedDataType &frame, void *context)
+{
+  // Look up the uint8_t variable named "sta" and turn the LED on or off based on the value
+  rw::mdt::fieldView sta;
+  if (frame.field("sta", sta))
+  {
+    if (sta.as<uint8_t>() == 0)
+      digitalWrite(LED_BUILTIN, LOW);
+    else if (sta.as<uint8_t>() == 1)
+      digitalWrite(LED_BUILTIN, HIGH);
+  }
+}
+
 // the setup function runs once when you press reset or power the board
 void setup() {
 
@@ -36,22 +50,19 @@ void setup() {
 
   // Instantiate / Initialize our device with the serial device and description we want to use
   myDevice = new rw::serial_device::SerialDevicePeripheral((HardwareSerial*)&Serial, desc);
+
+  // Register our command handler once, update() calls it directly when a matching packet arrives
+  myDevice->onCommand("cmd", "led", ledCommand);
   
 }
 
 // the loop function runs over and over again forever
 void loop() {
 
+  // Packets that no handler picked up are still available with available() / get<T>()
   if (myDevice->available()) // Check if there is data waiting in the buffer
   {
-    if (myDevice->get<std::string>("cmd") == "led") // Get a string variable named "cmd" (will return an empty string if "cmd" doesn't exist
-    {
-      // Get a uint8_t variable named "sta" and turn the LED on or off based on the value
-      if (myDevice->get<uint8_t>("sta") == 0)
-        digitalWrite(LED_BUILTIN, LOW);
-      else if (myDevice->get<uint8_t>("sta") == 1)
-        digitalWrite(LED_BUILTIN, HIGH);
-    }
+    // Handle any other data here
   }
 
   // Must call this update periodically to process SerialDevicePeripheral routines
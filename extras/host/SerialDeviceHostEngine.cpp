@@ -0,0 +1,474 @@
+#include "SerialDeviceHostEngine.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <random>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <termios.h>
+#include <unistd.h>
+
+namespace rw {
+  namespace serial_device {
+    namespace host {
+
+      namespace {
+        const uint32_t kWakeId = 0xFFFFFFFF;
+        const int kMaxEvents = 64;
+        const unsigned kIdleSpins = 64;
+
+        speed_t baudToSpeed(uint32_t baud) {
+          switch (baud) {
+            case 9600: return B9600;
+            case 19200: return B19200;
+            case 38400: return B38400;
+            case 57600: return B57600;
+            case 230400: return B230400;
+            case 460800: return B460800;
+            case 921600: return B921600;
+            default: return B115200;
+          }
+        }
+      }
+
+      bool Record::decode(rawFrame &frame, unsigned worker) {
+          // Swap rather than copy, the buffer the record held before is left in frame for
+          // workerLoop() to hand back to the I/O thread
+          frame_.port = frame.port;
+          frame_.cmd = frame.cmd;
+          frame_.has_timestamp = frame.has_timestamp;
+          frame_.device_timestamp = frame.device_timestamp;
+          frame_.rx_time = frame.rx_time;
+          frame_.payload.swap(frame.payload);
+          worker_ = worker;
+          clearData();
+          // Stream packets carry raw bytes rather than key / value data
+          if (frame_.payload.empty() || frame_.cmd == SD_COMMAND_STREAM_CHUNK || frame_.cmd == SD_COMMAND_STREAM_ACK)
+              return true;
+          try {
+              deserialize(frame_.payload);
+          } catch (const std::out_of_range &) {
+              clearData();
+              return false;
+          }
+          return true;
+      }
+
+      int Record::port() const {
+          return frame_.port;
+      }
+
+      unsigned Record::worker() const {
+          return worker_;
+      }
+
+      uint8_t Record::command() const {
+          return frame_.cmd;
+      }
+
+      const std::vector<uint8_t> &Record::payload() const {
+          return frame_.payload;
+      }
+
+      bool Record::hasDeviceTimestamp() const {
+          return frame_.has_timestamp;
+      }
+
+      uint32_t Record::deviceTimestamp() const {
+          return frame_.device_timestamp;
+      }
+
+      timePoint Record::rxTime() const {
+          return frame_.rx_time;
+      }
+
+      HostEngine::HostEngine(const engineOptions &options) : options_(options) {
+          if (options_.workers == 0)
+              options_.workers = 1;
+          if (options_.read_size == 0)
+              options_.read_size = 4096;
+          epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+          wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+          epoll_event ev{};
+          ev.events = EPOLLIN;
+          ev.data.u32 = kWakeId;
+          epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+      }
+
+      HostEngine::~HostEngine() {
+          stop();
+          for (auto &p : ports_)
+              closePort(*p);
+          close(wake_fd_);
+          close(epoll_fd_);
+      }
+
+      int HostEngine::openPort(const std::string &path, uint32_t baud) {
+          int fd = open(path.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+          if (fd < 0)
+              return -1;
+          termios tty{};
+          if (tcgetattr(fd, &tty) == 0) {
+              cfmakeraw(&tty);
+              cfsetispeed(&tty, baudToSpeed(baud));
+              cfsetospeed(&tty, baudToSpeed(baud));
+              tty.c_cflag |= CLOCAL | CREAD;
+              tcsetattr(fd, TCSANOW, &tty);
+          }
+          int port = addPort(fd);
+          if (port < 0)
+              close(fd);
+          else
+              ports_.at(port)->owned = true;
+          return port;
+      }
+
+      int HostEngine::addPort(int fd) {
+          if (running_ || fd < 0)
+              return -1;
+          int flags = fcntl(fd, F_GETFL, 0);
+          if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+              return -1;
+
+          int port = (int) ports_.size();
+          epoll_event ev{};
+          ev.events = EPOLLIN;
+          ev.data.u32 = (uint32_t) port;
+          if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0)
+              return -1;
+
+          std::unique_ptr<Port> p(new Port());
+          p->fd = fd;
+          p->owned = false;
+          p->open = true;
+          p->worker = (unsigned) port % options_.workers;
+          p->parser.reset(new PacketParser(crc_));
+          p->acks = 0;
+          // Random start so a restarted host doesn't reuse the seqs the device last saw
+          p->stream_seq = (uint16_t) std::random_device()();
+          ports_.push_back(std::move(p));
+          return port;
+      }
+
+      std::size_t HostEngine::portCount() const {
+          return ports_.size();
+      }
+
+      bool HostEngine::start(recordHandler handler) {
+          if (running_ || !handler)
+              return false;
+          handler_ = std::move(handler);
+          io_done_ = false;
+          running_ = true;
+          workers_.clear();
+          for (unsigned i = 0; i < options_.workers; i++)
+              workers_.emplace_back(new Worker(options_.queue_capacity));
+          for (unsigned i = 0; i < options_.workers; i++)
+              workers_[i]->thread = std::thread(&HostEngine::workerLoop, this, i);
+          io_thread_ = std::thread(&HostEngine::ioLoop, this);
+          return true;
+      }
+
+      void HostEngine::stop() {
+          if (!running_.exchange(false))
+              return;
+          uint64_t one = 1;
+          if (write(wake_fd_, &one, sizeof(one)) < 0) {
+              // epoll_wait times out on its own, the wake up is only to stop faster
+          }
+          for (auto &p : ports_) {
+              std::lock_guard<std::mutex> lock(p->ack_mutex);
+              p->ack_cv.notify_all();
+          }
+          io_thread_.join();
+          for (auto &w : workers_)
+              w->thread.join();
+      }
+
+      bool HostEngine::running() const {
+          return running_;
+      }
+
+      bool HostEngine::send(int port, uint8_t cmd, const std::vector<uint8_t> &payload) {
+          if (port < 0 || port >= (int) ports_.size() || payload.size() > 0xFFFF - 4)
+              return false;
+          Port &p = *ports_[port];
+
+          std::vector<uint8_t> out;
+          out.reserve(payload.size() + 8);
+          uint16_t pSize = (uint16_t) (payload.size() + 4);
+          out.push_back(kPacketHeader);
+          out.push_back(kPacketId);
+          out.push_back(pSize >> 8);
+          out.push_back(pSize & 0xFF);
+          out.push_back(cmd);
+          out.insert(out.end(), payload.begin(), payload.end());
+          uint16_t calcCRC16 = crc_.calculate(payload.data(), 0, (int) payload.size());
+          out.push_back(calcCRC16 >> 8);
+          out.push_back(calcCRC16 & 0xFF);
+          out.push_back(kPacketStop);
+
+          std::lock_guard<std::mutex> lock(p.write_mutex);
+          std::size_t written = 0;
+          while (written < out.size()) {
+              if (!p.open)
+                  return false;
+              ssize_t r = write(p.fd, out.data() + written, out.size() - written);
+              if (r > 0) {
+                  written += (std::size_t) r;
+              } else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                  pollfd pfd{p.fd, POLLOUT, 0};
+                  poll(&pfd, 1, 100);
+              } else if (r < 0 && errno == EINTR) {
+                  continue;
+              } else {
+                  return false;
+              }
+          }
+          return true;
+      }
+
+      bool HostEngine::ping(int port, uint32_t token) {
+          mdt::DataPacket packet;
+          packet.add("tok", token);
+          std::vector<uint8_t> payload;
+          packet.serialize(payload);
+          return send(port, SD_COMMAND_PING, payload);
+      }
+
+      bool HostEngine::sendStream(int port, uint8_t streamId, const uint8_t *data, uint32_t size, uint16_t chunkSize) {
+          // The io thread is what reads the acks
+          if (!running_ || port < 0 || port >= (int) ports_.size() || chunkSize == 0 || chunkSize > 0xFFFF - 4 - kStreamHeaderSize)
+              return false;
+          Port &p = *ports_[port];
+          streamChunk chunk{};
+          chunk.stream_id = streamId;
+          chunk.total = size;
+          chunk.seq = p.stream_seq++;
+          uint16_t crc = 0;
+          unsigned retries = 0;
+          std::vector<uint8_t> payload;
+          for (;;) {
+              uint16_t n = (uint16_t) std::min<uint32_t>(chunkSize, size - chunk.offset);
+              chunk.crc = crc_.calculate(data + chunk.offset, 0, n, crc);
+              payload.resize(kStreamHeaderSize + n);
+              writeStreamHeader(payload.data(), chunk);
+              std::copy(data + chunk.offset, data + chunk.offset + n, payload.begin() + kStreamHeaderSize);
+              uint64_t seen;
+              {
+                  std::lock_guard<std::mutex> lock(p.ack_mutex);
+                  seen = p.acks;
+              }
+              if (!send(port, SD_COMMAND_STREAM_CHUNK, payload))
+                  return false;
+
+              streamAck ack;
+              if (!waitStreamAck(p, seen, chunk, ack)) {
+                  if (!running_ || ++retries > kStreamRetries)
+                      return false;
+                  continue;
+              }
+              if (ack.status == SD_STREAM_ABORTED || ack.received > size)
+                  return false;
+              if (ack.status != SD_STREAM_ERROR && ack.received == chunk.offset + n) {
+                  crc = chunk.crc;
+                  chunk.offset += n;
+                  chunk.seq = p.stream_seq++;
+                  retries = 0;
+                  if (chunk.offset == size)
+                      return true;
+                  continue;
+              }
+              // The whole object is here, so carry on from wherever the device got up to
+              if (++retries > kStreamRetries)
+                  return false;
+              chunk.offset = ack.received;
+              crc = crc_.calculate(data, 0, (int) chunk.offset);
+          }
+      }
+
+      bool HostEngine::ackStream(int port, const StreamReceiver &receiver) {
+          std::vector<uint8_t> payload(kStreamAckSize);
+          writeStreamAck(payload.data(), receiver.ack());
+          return send(port, SD_COMMAND_STREAM_ACK, payload);
+      }
+
+      bool HostEngine::waitStreamAck(Port &p, uint64_t seen, const streamChunk &chunk, streamAck &ack) {
+          auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(kStreamAckTimeoutMs);
+          std::unique_lock<std::mutex> lock(p.ack_mutex);
+          for (;;) {
+              if (!p.ack_cv.wait_until(lock, deadline, [&] { return p.acks != seen || !running_; }) || !running_)
+                  return false;
+              seen = p.acks;
+              // Late acks for an earlier attempt are skipped
+              if (p.ack.stream_id == chunk.stream_id && p.ack.seq == chunk.seq) {
+                  ack = p.ack;
+                  return true;
+              }
+          }
+      }
+
+      engineStats HostEngine::stats() const {
+          engineStats s{};
+          s.bytes_read = bytes_read_.load(std::memory_order_relaxed);
+          s.frames_parsed = frames_parsed_.load(std::memory_order_relaxed);
+          s.crc_errors = crc_errors_.load(std::memory_order_relaxed);
+          s.frame_errors = frame_errors_.load(std::memory_order_relaxed);
+          for (auto &w : workers_) {
+              s.frames_dispatched += w->frames.load(std::memory_order_relaxed);
+              s.decode_errors += w->decode_errors.load(std::memory_order_relaxed);
+          }
+          return s;
+      }
+
+      void HostEngine::ioLoop() {
+          std::vector<uint8_t> buffer(options_.read_size);
+          epoll_event events[kMaxEvents];
+          while (running_) {
+              int n = epoll_wait(epoll_fd_, events, kMaxEvents, 100);
+              if (n < 0) {
+                  if (errno == EINTR)
+                      continue;
+                  break;
+              }
+              for (int i = 0; i < n; i++) {
+                  uint32_t id = events[i].data.u32;
+                  if (id == kWakeId) {
+                      uint64_t count;
+                      if (read(wake_fd_, &count, sizeof(count)) < 0) {
+                          // Nothing to drain
+                      }
+                      continue;
+                  }
+                  if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                      readPort((int) id, buffer);
+              }
+          }
+          io_done_ = true;
+          for (auto &w : workers_)
+              wakeWorker(*w);
+      }
+
+      void HostEngine::readPort(int port, std::vector<uint8_t> &buffer) {
+          Port &p = *ports_[port];
+          for (;;) {
+              ssize_t r = read(p.fd, buffer.data(), buffer.size());
+              if (r > 0) {
+                  bytes_read_.fetch_add((uint64_t) r, std::memory_order_relaxed);
+                  for (ssize_t i = 0; i < r; i++) {
+                      kParseResult result = p.parser->parse(buffer[i]);
+                      if (result == SD_PARSE_COMPLETE)
+                          dispatch(port, p);
+                      else if (result == SD_PARSE_CRC_ERROR)
+                          crc_errors_.fetch_add(1, std::memory_order_relaxed);
+                      else if (result == SD_PARSE_FRAME_ERROR)
+                          frame_errors_.fetch_add(1, std::memory_order_relaxed);
+                  }
+                  if ((std::size_t) r < buffer.size())
+                      return;
+              } else if (r < 0 && errno == EINTR) {
+                  continue;
+              } else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                  return;
+              } else {
+                  // EOF or EIO, the device went away (a pty reports EIO once the other end closes)
+                  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, p.fd, nullptr);
+                  p.open = false;
+                  return;
+              }
+          }
+      }
+
+      void HostEngine::dispatch(int port, Port &p) {
+          frames_parsed_.fetch_add(1, std::memory_order_relaxed);
+          rawFrame frame;
+          frame.port = port;
+          frame.cmd = p.parser->command();
+          frame.has_timestamp = p.parser->hasTimestamp();
+          frame.device_timestamp = p.parser->timestamp();
+          frame.payload.swap(p.parser->payload());
+          frame.rx_time = std::chrono::steady_clock::now();
+          // Give the parser a used buffer so the next frame doesn't grow one from scratch
+          if (!workers_[p.worker]->spare.tryPop(p.parser->payload()))
+              p.parser->payload().reserve(frame.payload.size());
+
+          if (frame.cmd == SD_COMMAND_STREAM_ACK) {
+              std::lock_guard<std::mutex> lock(p.ack_mutex);
+              if (readStreamAck(frame.payload.data(), frame.payload.size(), p.ack)) {
+                  p.acks++;
+                  p.ack_cv.notify_all();
+              }
+          }
+
+          // Back pressure: if the worker falls behind stop reading until it catches up,
+          // the kernel tty buffers hold the data in the meantime
+          Worker &w = *workers_[p.worker];
+          while (!w.queue.tryPush(std::move(frame))) {
+              if (!running_)
+                  return;
+              std::this_thread::yield();
+          }
+          wakeWorker(w);
+      }
+
+      void HostEngine::wakeWorker(Worker &w) {
+          // Pairs with the fence in workerLoop(), either the worker sees the frame before it
+          // parks or this sees it parked
+          std::atomic_thread_fence(std::memory_order_seq_cst);
+          if (!w.parked.load(std::memory_order_relaxed))
+              return;
+          std::lock_guard<std::mutex> lock(w.park_mutex);
+          w.parked.store(false, std::memory_order_relaxed);
+          w.park_cv.notify_one();
+      }
+
+      void HostEngine::closePort(Port &p) {
+          if (p.open)
+              epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, p.fd, nullptr);
+          p.open = false;
+          if (p.owned && p.fd >= 0)
+              close(p.fd);
+          p.fd = -1;
+      }
+
+      void HostEngine::workerLoop(unsigned index) {
+          Worker &w = *workers_[index];
+          Record record;
+          rawFrame frame;
+          unsigned idle = 0;
+          for (;;) {
+              if (w.queue.tryPop(frame)) {
+                  idle = 0;
+                  if (record.decode(frame, index))
+                      handler_(record);
+                  else
+                      w.decode_errors.fetch_add(1, std::memory_order_relaxed);
+                  w.frames.fetch_add(1, std::memory_order_relaxed);
+                  // If the I/O thread already has plenty the buffer is just freed
+                  frame.payload.clear();
+                  w.spare.tryPush(std::move(frame.payload));
+                  continue;
+              }
+              // io_done_ has to be checked before empty(), nothing is pushed once it is set
+              if (io_done_ && w.queue.empty())
+                  return;
+              if (++idle < kIdleSpins) {
+                  std::this_thread::yield();
+                  continue;
+              }
+              // Sleep until dispatch() pushes a frame or the I/O thread finishes
+              std::unique_lock<std::mutex> lock(w.park_mutex);
+              w.parked.store(true, std::memory_order_relaxed);
+              std::atomic_thread_fence(std::memory_order_seq_cst);
+              if (w.queue.empty() && !io_done_)
+                  w.park_cv.wait(lock, [&] { return !w.parked.load(std::memory_order_relaxed); });
+              w.parked.store(false, std::memory_order_relaxed);
+              idle = 0;
+          }
+      }
+    } // end namespace host
+  } // end namespace serial_device
+} // end namespace rw
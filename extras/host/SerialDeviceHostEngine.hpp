@@ -0,0 +1,173 @@
+/*
+ *  Serial Device Host Engine:
+ *      Linux host side engine for talking to large numbers of SerialDevicePeripheral
+ *      devices at once. A single I/O thread multiplexes every tty / pty with epoll and
+ *      runs the shared PacketParser on each port, completed frames are handed to a pool
+ *      of worker threads over lock-free SPSC queues where they are decoded and passed
+ *      to the user's handler.
+ *
+ *      Frames from one port always go to the same worker so they are handled in order.
+ */
+
+#ifndef SERIAL_DEVICE_HOST_ENGINE_HPP_
+#define SERIAL_DEVICE_HOST_ENGINE_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "MixedDataType.hpp"
+#include "SerialDevice.hpp"
+#include "SpscQueue.hpp"
+
+namespace rw {
+  namespace serial_device {
+    namespace host {
+
+      typedef std::chrono::steady_clock::time_point timePoint;
+
+      typedef struct rawFrame {
+          int port{-1};
+          uint8_t cmd{};
+          bool has_timestamp{};
+          uint32_t device_timestamp{};
+          std::vector<uint8_t> payload;
+          timePoint rx_time;
+      } rawFrame;
+
+      // Decoded frame handed to the record handler, only valid for the duration of the call
+      class Record : public mdt::MixedDataType {
+       public:
+        Record() = default;
+        ~Record() override = default;
+
+        bool decode(rawFrame &frame, unsigned worker);
+        int port() const;
+        unsigned worker() const;
+        uint8_t command() const;
+        bool hasDeviceTimestamp() const;
+        uint32_t deviceTimestamp() const;
+        const std::vector<uint8_t> &payload() const;
+        timePoint rxTime() const;
+
+       private:
+        rawFrame frame_;
+        unsigned worker_{};
+      };
+
+      typedef std::function<void(Record &record)> recordHandler;
+
+      typedef struct engineOptions {
+          unsigned workers{4};
+          std::size_t queue_capacity{4096};
+          std::size_t read_size{4096};
+      } engineOptions;
+
+      typedef struct engineStats {
+          uint64_t bytes_read;
+          uint64_t frames_parsed;
+          uint64_t frames_dispatched;
+          uint64_t crc_errors;
+          uint64_t frame_errors;
+          uint64_t decode_errors;
+      } engineStats;
+
+      class HostEngine {
+       public:
+        explicit HostEngine(const engineOptions &options = engineOptions());
+        ~HostEngine();
+
+        HostEngine(const HostEngine &) = delete;
+        HostEngine &operator=(const HostEngine &) = delete;
+
+        // Ports can only be added before start(), both return the port id or -1 on error
+        int openPort(const std::string &path, uint32_t baud = 115200);
+        int addPort(int fd);
+        std::size_t portCount() const;
+
+        bool start(recordHandler handler);
+        void stop();
+        bool running() const;
+
+        // Safe to call from any thread, including from inside the record handler
+        bool send(int port, uint8_t cmd, const std::vector<uint8_t> &payload);
+        // Round trip probe, the SD_COMMAND_PING_REPLY record echoes "tok" and carries the
+        // device's "rx" / "tx" micros() timestamps
+        bool ping(int port, uint32_t token);
+        // Sends data as SD_COMMAND_STREAM_CHUNK packets and blocks until the device acks the
+        // last one, each chunk waits for its SD_COMMAND_STREAM_ACK and is resent from what the
+        // device has received when it doesn't come or reports an error. Needs the engine running,
+        // don't call it from the record handler since the acks come in on the same port.
+        // Chunks bigger than kStreamChunkSize can overrun a small board's UART / RAM.
+        // One transfer per port at a time
+        bool sendStream(int port, uint8_t streamId, const uint8_t *data, uint32_t size, uint16_t chunkSize = kStreamChunkSize);
+        // Answers the chunk just passed to receiver, a device's sendStream() waits for this before
+        // sending the next one. Stream chunk / ack records are not decoded, use payload()
+        bool ackStream(int port, const StreamReceiver &receiver);
+        engineStats stats() const;
+
+       private:
+        struct Port {
+            int fd;
+            bool owned;
+            std::atomic<bool> open;
+            unsigned worker;
+            std::unique_ptr<PacketParser> parser;
+            std::mutex write_mutex;
+            // Last SD_COMMAND_STREAM_ACK, acks counts them so sendStream() can tell a new one arrived
+            std::mutex ack_mutex;
+            std::condition_variable ack_cv;
+            streamAck ack;
+            uint64_t acks;
+            // Next seq for sendStream(), carried on between transfers
+            uint16_t stream_seq;
+        };
+
+        struct Worker {
+            explicit Worker(std::size_t capacity) : queue(capacity), spare(capacity) {}
+            SpscQueue<rawFrame> queue;
+            // Payload buffers handed back to the I/O thread so the parser reuses their capacity
+            SpscQueue<std::vector<uint8_t>> spare;
+            std::thread thread;
+            alignas(64) std::atomic<uint64_t> frames{0};
+            std::atomic<uint64_t> decode_errors{0};
+            // Set while the worker sleeps on park_cv, dispatch() only takes the lock to wake it
+            alignas(64) std::atomic<bool> parked{false};
+            std::mutex park_mutex;
+            std::condition_variable park_cv;
+        };
+
+        void ioLoop();
+        void workerLoop(unsigned index);
+        void readPort(int port, std::vector<uint8_t> &buffer);
+        void dispatch(int port, Port &p);
+        bool waitStreamAck(Port &p, uint64_t seen, const streamChunk &chunk, streamAck &ack);
+        void closePort(Port &p);
+        void wakeWorker(Worker &w);
+
+        engineOptions options_;
+        CRC16 crc_;
+        std::vector<std::unique_ptr<Port>> ports_;
+        std::vector<std::unique_ptr<Worker>> workers_;
+        recordHandler handler_;
+        std::thread io_thread_;
+        int epoll_fd_;
+        int wake_fd_;
+        std::atomic<bool> running_{false};
+        std::atomic<bool> io_done_{false};
+        std::atomic<uint64_t> bytes_read_{0};
+        std::atomic<uint64_t> frames_parsed_{0};
+        std::atomic<uint64_t> crc_errors_{0};
+        std::atomic<uint64_t> frame_errors_{0};
+      };
+    } // end namespace host
+  } // end namespace serial_device
+} // end namespace rw
+#endif // SERIAL_DEVICE_HOST_ENGINE_HPP_
@@ -0,0 +1,78 @@
+/*
+ *  Single Producer / Single Consumer Queue:
+ *      Bounded lock-free ring buffer used to hand frames from the host engine's
+ *      I/O thread to each worker thread. Exactly one thread may push and exactly
+ *      one (other) thread may pop.
+ */
+
+#ifndef SPSC_QUEUE_HPP_
+#define SPSC_QUEUE_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace rw {
+  namespace serial_device {
+    namespace host {
+
+      template <typename T>
+      class SpscQueue {
+       public:
+        // Capacity is rounded up to the next power of two
+        explicit SpscQueue(std::size_t capacity) {
+          std::size_t size = 2;
+          while (size < capacity)
+            size <<= 1;
+          slots_.resize(size);
+          mask_ = size - 1;
+        }
+        ~SpscQueue() = default;
+
+        SpscQueue(const SpscQueue &) = delete;
+        SpscQueue &operator=(const SpscQueue &) = delete;
+
+        bool tryPush(T &&item) {
+          const std::size_t tail = tail_.load(std::memory_order_relaxed);
+          if (tail - head_cache_ == slots_.size()) {
+            head_cache_ = head_.load(std::memory_order_acquire);
+            if (tail - head_cache_ == slots_.size())
+              return false;
+          }
+          slots_[tail & mask_] = std::move(item);
+          tail_.store(tail + 1, std::memory_order_release);
+          return true;
+        }
+
+        bool tryPop(T &item) {
+          const std::size_t head = head_.load(std::memory_order_relaxed);
+          if (head == tail_cache_) {
+            tail_cache_ = tail_.load(std::memory_order_acquire);
+            if (head == tail_cache_)
+              return false;
+          }
+          item = std::move(slots_[head & mask_]);
+          head_.store(head + 1, std::memory_order_release);
+          return true;
+        }
+
+        bool empty() const {
+          return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+        }
+
+       private:
+        std::vector<T> slots_;
+        std::size_t mask_;
+
+        // Producer and consumer indices live on separate cache lines so the two
+        // threads don't bounce the same line back and forth
+        alignas(64) std::atomic<std::size_t> tail_{0};
+        std::size_t head_cache_{0};
+        alignas(64) std::atomic<std::size_t> head_{0};
+        std::size_t tail_cache_{0};
+      };
+    } // end namespace host
+  } // end namespace serial_device
+} // end namespace rw
+#endif // SPSC_QUEUE_HPP_
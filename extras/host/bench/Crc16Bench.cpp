@@ -0,0 +1,96 @@
+/*
+ *  CRC16 Benchmark:
+ *      Checks CRC16::calculate() is bit-exact with the original byte at a time table over
+ *      random lengths and offsets, then compares throughput for frame sized and bulk buffers.
+ *
+ *  Build (from the repository root):
+ *      g++ -std=c++17 -O2 -Isrc extras/host/bench/Crc16Bench.cpp -o crc16_bench
+ *
+ *  Add -DSD_CRC16_NO_CLMUL to measure the slicing-by-16 tables on their own.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "SerialDevice.hpp"
+
+using namespace rw::serial_device;
+
+namespace {
+  // The original CRC16::calculate() loop
+  uint16_t referenceCRC(const uint8_t *message, int startByte, int endByte) {
+      static uint16_t table[256];
+      static bool init = false;
+      if (!init) {
+          for (int dividend = 0; dividend < 256; ++dividend) {
+              uint16_t remainder = (uint16_t)(dividend << 8);
+              for (int bit = 8; bit > 0; --bit)
+                  remainder = (remainder & 0x8000) ? (uint16_t)((remainder << 1) ^ 0x1021) : (uint16_t)(remainder << 1);
+              table[dividend] = remainder;
+          }
+          init = true;
+      }
+      uint16_t remainder = 0;
+      for (int byte = startByte; byte < endByte; ++byte)
+          remainder = (uint16_t)(table[message[byte] ^ (remainder >> 8)] ^ (remainder << 8));
+      return remainder;
+  }
+
+  template <typename F>
+  double measure(F fn, std::size_t bytes_per_call, std::size_t total_bytes) {
+      std::size_t calls = total_bytes / bytes_per_call + 1;
+      volatile uint16_t sink = 0;
+      auto start = std::chrono::steady_clock::now();
+      for (std::size_t i = 0; i < calls; i++)
+          sink = sink ^ fn();
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      return (double) (calls * bytes_per_call) / seconds / 1e9;
+  }
+}
+
+int main() {
+    CRC16 crc;
+    std::mt19937 rng(1234);
+    std::vector<uint8_t> buffer(1 << 24);
+    for (auto &b : buffer)
+        b = (uint8_t) rng();
+
+    // Known answer for CRC-CCITT (XMODEM)
+    const uint8_t check[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+    if (crc.calculate(check, 0, 9) != 0x31C3) {
+        printf("FAIL check value %04X\n", crc.calculate(check, 0, 9));
+        return 1;
+    }
+
+    unsigned mismatches = 0;
+    std::uniform_int_distribution<int> start_dist(0, 64);
+    std::uniform_int_distribution<int> len_dist(0, 4096);
+    for (int i = 0; i < 20000; i++) {
+        int start = start_dist(rng);
+        int end = start + (i < 1000 ? i : len_dist(rng));
+        if (crc.calculate(buffer.data(), start, end) != referenceCRC(buffer.data(), start, end))
+            mismatches++;
+    }
+    if (mismatches) {
+        printf("FAIL %u mismatches against the reference\n", mismatches);
+        return 1;
+    }
+#ifdef SD_CRC16_FAST
+    printf("bit-exact over 20000 random buffers, backend: %s\n", crc_fast::backend());
+#else
+    printf("bit-exact over 20000 random buffers, backend: bytewise\n");
+#endif
+
+    const std::size_t sizes[] = {32, 256, 4096, 1 << 20, 1 << 24};
+    printf("%10s %14s %14s %9s\n", "bytes", "bytewise GB/s", "calculate GB/s", "speedup");
+    for (std::size_t size : sizes) {
+        const std::size_t total = std::max<std::size_t>(size, 256u << 20);
+        double ref = measure([&] { return referenceCRC(buffer.data(), 0, (int) size); }, size, total / 4);
+        double fast = measure([&] { return crc.calculate(buffer.data(), 0, (int) size); }, size, total);
+        printf("%10zu %14.2f %14.2f %8.1fx\n", size, ref, fast, fast / ref);
+    }
+    return 0;
+}
@@ -0,0 +1,209 @@
+/*
+ *  Host Engine Benchmark:
+ *      Opens a pty per simulated device and runs the real SerialDevicePeripheral code on
+ *      the slave side through the mock HardwareSerial in WProgram.h, the HostEngine reads
+ *      every master side. Reports aggregate frames/s and frame latency (peripheral
+ *      sendPacket() to record handler) percentiles.
+ *
+ *  Build (from the repository root):
+ *      g++ -std=c++17 -O2 -pthread -Iextras/host/bench -Iextras/host -Isrc \
+ *          extras/host/bench/HostEngineBench.cpp extras/host/SerialDeviceHostEngine.cpp \
+ *          src/SerialDevicePeripheral.cpp -o host_engine_bench
+ *
+ *  Usage:
+ *      ./host_engine_bench [--ports N] [--frames N] [--workers N] [--device-threads N] [--interval-us N]
+ *
+ *      --interval-us paces each device, the default of 0 sends flat out which measures
+ *      throughput, latency under saturation mostly shows time queued in the tty buffers.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <termios.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "SerialDeviceHostEngine.hpp"
+#include "SerialDevicePeripheral.hpp"
+
+using namespace rw::serial_device;
+
+namespace {
+  typedef struct benchOptions {
+      unsigned ports{128};
+      unsigned frames{2000};
+      unsigned workers{4};
+      unsigned device_threads{4};
+      unsigned interval_us{0};
+  } benchOptions;
+
+  typedef struct simDevice {
+      int master_fd;
+      int slave_fd;
+      std::unique_ptr<HardwareSerial> serial;
+      std::unique_ptr<SerialDevicePeripheral> device;
+  } simDevice;
+
+  double nowMicros() {
+      using namespace std::chrono;
+      return (double) duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+  }
+
+  bool openPty(simDevice &sim) {
+      sim.master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+      if (sim.master_fd < 0 || grantpt(sim.master_fd) != 0 || unlockpt(sim.master_fd) != 0)
+          return false;
+      sim.slave_fd = open(ptsname(sim.master_fd), O_RDWR | O_NOCTTY);
+      if (sim.slave_fd < 0)
+          return false;
+      // Raw mode on both ends, otherwise the line discipline mangles the binary packets
+      termios tty{};
+      tcgetattr(sim.slave_fd, &tty);
+      cfmakeraw(&tty);
+      tcsetattr(sim.slave_fd, TCSANOW, &tty);
+      tcgetattr(sim.master_fd, &tty);
+      cfmakeraw(&tty);
+      tcsetattr(sim.master_fd, TCSANOW, &tty);
+      return true;
+  }
+
+  void runDevices(std::vector<simDevice> &sims, unsigned first, unsigned step, unsigned frames, unsigned interval_us) {
+      for (unsigned i = 0; i < frames; i++) {
+          for (unsigned d = first; d < sims.size(); d += step) {
+              SerialDevicePeripheral &dev = *sims[d].device;
+              dev.update();
+              dev.add("seq", (uint32_t) i);
+              dev.add("val", (float) i * 0.5f);
+              dev.add("ts", nowMicros());
+              dev.sendPacket();
+          }
+          if (interval_us)
+              std::this_thread::sleep_for(std::chrono::microseconds(interval_us));
+      }
+  }
+
+  unsigned argValue(int argc, char **argv, int &i) {
+      if (i + 1 >= argc) {
+          fprintf(stderr, "missing value for %s\n", argv[i]);
+          exit(1);
+      }
+      return (unsigned) strtoul(argv[++i], nullptr, 10);
+  }
+}
+
+int main(int argc, char **argv) {
+    benchOptions opt;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--ports"))
+            opt.ports = argValue(argc, argv, i);
+        else if (!strcmp(argv[i], "--frames"))
+            opt.frames = argValue(argc, argv, i);
+        else if (!strcmp(argv[i], "--workers"))
+            opt.workers = argValue(argc, argv, i);
+        else if (!strcmp(argv[i], "--device-threads"))
+            opt.device_threads = argValue(argc, argv, i);
+        else if (!strcmp(argv[i], "--interval-us"))
+            opt.interval_us = argValue(argc, argv, i);
+        else {
+            fprintf(stderr, "usage: %s [--ports N] [--frames N] [--workers N] [--device-threads N] [--interval-us N]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (opt.workers == 0)
+        opt.workers = 1;
+    if (opt.device_threads == 0)
+        opt.device_threads = 1;
+
+    host::engineOptions eo;
+    eo.workers = opt.workers;
+    host::HostEngine engine(eo);
+
+    std::vector<simDevice> sims(opt.ports);
+    for (unsigned i = 0; i < opt.ports; i++) {
+        if (!openPty(sims[i])) {
+            perror("pty");
+            return 1;
+        }
+        sims[i].serial.reset(new HardwareSerial(sims[i].slave_fd));
+        sims[i].device.reset(new SerialDevicePeripheral(sims[i].serial.get()));
+        sims[i].device->setSerial(i + 1);
+        if (engine.addPort(sims[i].master_fd) < 0) {
+            fprintf(stderr, "failed to add port %u\n", i);
+            return 1;
+        }
+    }
+
+    // Per worker latency samples so the handler never has to take a lock
+    std::vector<std::vector<uint32_t>> latencies(opt.workers);
+    for (auto &l : latencies)
+        l.reserve((std::size_t) opt.ports * opt.frames / opt.workers + 1024);
+    std::atomic<uint64_t> data_frames{0};
+    std::atomic<uint64_t> info_frames{0};
+
+    engine.start([&](host::Record &record) {
+        if (record.command() == SD_COMMAND_SEND_INFO) {
+            info_frames.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        double sent = record.get<double>("ts");
+        latencies[record.worker()].push_back((uint32_t) std::max(0.0, nowMicros() - sent));
+        data_frames.fetch_add(1, std::memory_order_relaxed);
+    });
+
+    // Exercise the host -> device direction too, each device answers with an info packet
+    for (unsigned i = 0; i < opt.ports; i++)
+        engine.send((int) i, SD_COMMAND_GET_INFO, std::vector<uint8_t>());
+
+    const uint64_t expected = (uint64_t) opt.ports * opt.frames;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < opt.device_threads; t++)
+        threads.emplace_back(runDevices, std::ref(sims), t, opt.device_threads, opt.frames, opt.interval_us);
+    for (auto &t : threads)
+        t.join();
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+    while (data_frames.load() < expected && std::chrono::steady_clock::now() < deadline)
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    auto end = std::chrono::steady_clock::now();
+    engine.stop();
+
+    std::vector<uint32_t> all;
+    for (auto &l : latencies)
+        all.insert(all.end(), l.begin(), l.end());
+    std::sort(all.begin(), all.end());
+    auto pct = [&](double p) -> uint32_t {
+        if (all.empty())
+            return 0;
+        return all[std::min(all.size() - 1, (std::size_t) (p * (double) all.size()))];
+    };
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    host::engineStats s = engine.stats();
+    printf("ports %u  workers %u  device threads %u  frames/port %u  interval %u us\n",
+           opt.ports, opt.workers, opt.device_threads, opt.frames, opt.interval_us);
+    printf("data frames  %llu / %llu  (info replies %llu)\n",
+           (unsigned long long) data_frames.load(), (unsigned long long) expected,
+           (unsigned long long) info_frames.load());
+    printf("throughput   %.0f frames/s  %.2f MB/s\n",
+           (double) data_frames.load() / seconds, (double) s.bytes_read / seconds / 1e6);
+    printf("latency us   p50 %u  p99 %u  max %u\n", pct(0.50), pct(0.99), all.empty() ? 0 : all.back());
+    printf("errors       crc %llu  frame %llu  decode %llu\n",
+           (unsigned long long) s.crc_errors, (unsigned long long) s.frame_errors,
+           (unsigned long long) s.decode_errors);
+
+    for (auto &sim : sims) {
+        close(sim.slave_fd);
+        close(sim.master_fd);
+    }
+    return data_frames.load() == expected ? 0 : 1;
+}
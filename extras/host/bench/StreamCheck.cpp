@@ -0,0 +1,389 @@
+/*
+ *  Stream Check:
+ *      Exercises the streaming resume / repeat handling. First StreamReceiver on its own (lost
+ *      acks, bad running CRCs, gaps, aborts and the same object sent twice), then whole
+ *      transfers both ways between the real SerialDevicePeripheral and HostEngine through a
+ *      relay that drops or corrupts chosen frames. Exits non-zero if any check fails.
+ *
+ *  Build (from the repository root):
+ *      g++ -std=c++17 -O2 -pthread -Iextras/host/bench -Iextras/host -Isrc \
+ *          extras/host/bench/StreamCheck.cpp extras/host/SerialDeviceHostEngine.cpp \
+ *          src/SerialDevicePeripheral.cpp -o stream_check
+ */
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <mutex>
+#include <poll.h>
+#include <termios.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "SerialDeviceHostEngine.hpp"
+#include "SerialDevicePeripheral.hpp"
+
+using namespace rw::serial_device;
+
+namespace {
+  unsigned failures = 0;
+
+  void check(bool ok, const char *name) {
+      printf("%s  %s\n", ok ? "PASS" : "FAIL", name);
+      if (!ok)
+          failures++;
+  }
+
+  typedef struct collected {
+      std::vector<uint8_t> data;
+      unsigned chunks{0};
+      unsigned completed{0};
+      bool refuse{false};
+  } collected;
+
+  bool collect(const streamChunk &chunk, void *context) {
+      collected &c = *(collected *) context;
+      if (c.refuse)
+          return false;
+      if (chunk.offset == 0)
+          c.data.clear();
+      c.data.insert(c.data.end(), chunk.data, chunk.data + chunk.size);
+      c.chunks++;
+      if (chunk.last)
+          c.completed++;
+      return true;
+  }
+
+  // Builds chunk payloads of an object the way the senders do
+  class ChunkMaker {
+   public:
+    ChunkMaker(const std::vector<uint8_t> &object, uint16_t chunkSize) : object_(object), chunk_size_(chunkSize) {}
+
+    std::vector<uint8_t> make(uint8_t streamId, uint16_t seq, uint32_t offset) {
+        uint16_t n = (uint16_t) std::min<uint32_t>(chunk_size_, (uint32_t) object_.size() - offset);
+        streamChunk chunk{};
+        chunk.stream_id = streamId;
+        chunk.seq = seq;
+        chunk.offset = offset;
+        chunk.total = (uint32_t) object_.size();
+        chunk.crc = crc_.calculate(object_.data(), 0, (int) (offset + n));
+        std::vector<uint8_t> payload(kStreamHeaderSize + n);
+        writeStreamHeader(payload.data(), chunk);
+        std::copy(object_.begin() + offset, object_.begin() + offset + n, payload.begin() + kStreamHeaderSize);
+        return payload;
+    }
+
+   private:
+    const std::vector<uint8_t> &object_;
+    uint16_t chunk_size_;
+    CRC16 crc_;
+  };
+
+  kStreamStatus feed(StreamReceiver &rx, const std::vector<uint8_t> &payload) {
+      return rx.receive(payload.data(), payload.size());
+  }
+
+  void receiverChecks(const std::vector<uint8_t> &object) {
+      CRC16 crc;
+      ChunkMaker maker(object, 100);
+
+      {
+          collected c;
+          StreamReceiver rx(crc);
+          rx.setSink(collect, &c);
+          feed(rx, maker.make(1, 10, 0));
+          feed(rx, maker.make(1, 11, 100));
+          // Ack for seq 11 lost, the sender repeats it
+          kStreamStatus repeat = feed(rx, maker.make(1, 11, 100));
+          check(repeat == SD_STREAM_RECEIVING && rx.received() == 200 && c.chunks == 2, "lost ack: repeat is re-acked without reaching the sink");
+          feed(rx, maker.make(1, 12, 200));
+          check(rx.status() == SD_STREAM_COMPLETE && c.data == object, "lost ack: transfer completes intact");
+          kStreamStatus last = feed(rx, maker.make(1, 12, 200));
+          check(last == SD_STREAM_COMPLETE && c.completed == 1, "lost ack: repeat of the final chunk keeps it complete");
+      }
+
+      {
+          collected c;
+          StreamReceiver rx(crc);
+          rx.setSink(collect, &c);
+          feed(rx, maker.make(2, 0, 0));
+          std::vector<uint8_t> bad = maker.make(2, 1, 100);
+          bad[kStreamHeaderSize + 5] ^= 0x40;
+          kStreamStatus status = feed(rx, bad);
+          check(status == SD_STREAM_ERROR && rx.received() == 100 && rx.ack().received == 100, "crc error: chunk rejected, received unchanged");
+          feed(rx, maker.make(2, 1, 100));
+          feed(rx, maker.make(2, 2, 200));
+          check(rx.status() == SD_STREAM_COMPLETE && c.data == object, "crc error: resend from received resumes and completes");
+      }
+
+      {
+          collected c;
+          StreamReceiver rx(crc);
+          rx.setSink(collect, &c);
+          feed(rx, maker.make(3, 0, 0));
+          kStreamStatus gap = feed(rx, maker.make(3, 2, 200));
+          check(gap == SD_STREAM_ERROR && rx.received() == 100, "gap: out of order chunk rejected");
+          feed(rx, maker.make(3, 1, 100));
+          feed(rx, maker.make(3, 2, 200));
+          check(rx.status() == SD_STREAM_COMPLETE && c.data == object, "gap: resumes from received");
+      }
+
+      {
+          collected c;
+          StreamReceiver rx(crc);
+          rx.setSink(collect, &c);
+          feed(rx, maker.make(4, 0, 0));
+          c.refuse = true;
+          kStreamStatus aborted = feed(rx, maker.make(4, 1, 100));
+          c.refuse = false;
+          kStreamStatus after = feed(rx, maker.make(4, 2, 200));
+          check(aborted == SD_STREAM_ABORTED && after == SD_STREAM_ABORTED, "abort: sink refusal is final");
+          feed(rx, maker.make(4, 3, 0));
+          check(rx.status() == SD_STREAM_RECEIVING, "abort: a new stream starts again");
+      }
+
+      {
+          // The same single chunk object sent twice, the second transfer carries on the seq
+          std::vector<uint8_t> small(object.begin(), object.begin() + 50);
+          ChunkMaker smallMaker(small, 100);
+          collected c;
+          StreamReceiver rx(crc);
+          rx.setSink(collect, &c);
+          feed(rx, smallMaker.make(5, 7, 0));
+          feed(rx, smallMaker.make(5, 8, 0));
+          check(c.completed == 2, "repeated transfer: fresh seq reaches the sink again");
+      }
+  }
+
+  /*
+   *  Lossy link:
+   *      Sits between two ptys, one end for the device and one for the host engine, and
+   *      forwards whole frames. The rule decides per frame whether it goes through, is
+   *      dropped or has a payload byte flipped (so the receiver's frame CRC fails).
+   */
+  typedef enum kFault {
+    FAULT_NONE,
+    FAULT_DROP,
+    FAULT_CORRUPT
+  } kFault;
+
+  // toDevice, command and how many frames with that command went that way before this one
+  typedef std::function<kFault(bool toDevice, uint8_t cmd, unsigned index)> faultRule;
+
+  bool openPty(int &master, int &slave) {
+      master = posix_openpt(O_RDWR | O_NOCTTY);
+      if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+          return false;
+      slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+      if (slave < 0)
+          return false;
+      termios tty{};
+      tcgetattr(slave, &tty);
+      cfmakeraw(&tty);
+      tcsetattr(slave, TCSANOW, &tty);
+      tcgetattr(master, &tty);
+      cfmakeraw(&tty);
+      tcsetattr(master, TCSANOW, &tty);
+      return true;
+  }
+
+  void writeAll(int fd, const uint8_t *data, std::size_t size) {
+      while (size > 0) {
+          ssize_t r = write(fd, data, size);
+          if (r <= 0)
+              return;
+          data += r;
+          size -= (std::size_t) r;
+      }
+  }
+
+  class LossyLink {
+   public:
+    LossyLink(int deviceFd, int hostFd) : fds_{deviceFd, hostFd}, parsers_{PacketParser(crc_), PacketParser(crc_)} {}
+
+    ~LossyLink() {
+        stop();
+    }
+
+    void setRule(faultRule rule) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        rule_ = rule;
+        for (auto &c : counts_)
+            c.assign(256, 0);
+    }
+
+    void start() {
+        setRule(faultRule());
+        running_ = true;
+        thread_ = std::thread(&LossyLink::run, this);
+    }
+
+    void stop() {
+        if (running_.exchange(false))
+            thread_.join();
+    }
+
+   private:
+    void run() {
+        uint8_t buffer[512];
+        while (running_) {
+            pollfd pfd[2] = {{fds_[0], POLLIN, 0}, {fds_[1], POLLIN, 0}};
+            if (poll(pfd, 2, 20) <= 0)
+                continue;
+            // Side 0 is the device, what it sends goes to the host and the other way round
+            for (int side = 0; side < 2; side++) {
+                if (!(pfd[side].revents & POLLIN))
+                    continue;
+                ssize_t r = read(fds_[side], buffer, sizeof(buffer));
+                for (ssize_t i = 0; i < r; i++) {
+                    pending_[side].push_back(buffer[i]);
+                    kParseResult result = parsers_[side].parse(buffer[i]);
+                    if (result == SD_PARSE_INCOMPLETE)
+                        continue;
+                    if (result == SD_PARSE_COMPLETE)
+                        forward(side);
+                    pending_[side].clear();
+                }
+            }
+        }
+    }
+
+    void forward(int side) {
+        bool toDevice = side == 1;
+        uint8_t cmd = parsers_[side].command();
+        std::vector<uint8_t> &frame = pending_[side];
+        kFault fault = FAULT_NONE;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (rule_)
+                fault = rule_(toDevice, cmd, counts_[side][cmd]);
+            counts_[side][cmd]++;
+        }
+        if (fault == FAULT_DROP)
+            return;
+        if (fault == FAULT_CORRUPT && frame.size() > 8)
+            frame[frame.size() - 4] ^= 0x01;
+        writeAll(fds_[1 - side], frame.data(), frame.size());
+    }
+
+    CRC16 crc_;
+    int fds_[2];
+    PacketParser parsers_[2];
+    std::vector<uint8_t> pending_[2];
+    std::vector<unsigned> counts_[2];
+    std::mutex mutex_;
+    faultRule rule_;
+    std::atomic<bool> running_{false};
+    std::thread thread_;
+  };
+
+  std::vector<uint8_t> *deviceObject = nullptr;
+
+  uint16_t objectSource(uint32_t offset, uint8_t *buffer, uint16_t size, void *) {
+      memcpy(buffer, deviceObject->data() + offset, size);
+      return size;
+  }
+}
+
+int main() {
+    std::vector<uint8_t> object(300);
+    srand(1234);
+    for (auto &b : object)
+        b = (uint8_t) rand();
+
+    receiverChecks(object);
+
+    int deviceMaster, deviceSlave, hostMaster, hostSlave;
+    if (!openPty(deviceMaster, deviceSlave) || !openPty(hostMaster, hostSlave)) {
+        perror("pty");
+        return 1;
+    }
+    HardwareSerial serial(deviceSlave);
+    SerialDevicePeripheral device(&serial);
+    collected deviceGot;
+    device.onStream(collect, &deviceGot);
+
+    LossyLink link(deviceMaster, hostMaster);
+    link.start();
+
+    host::HostEngine engine;
+    engine.addPort(hostSlave);
+    CRC16 hostCrc;
+    StreamReceiver hostRx(hostCrc);
+    collected hostGot;
+    hostRx.setSink(collect, &hostGot);
+    engine.start([&](host::Record &record) {
+        if (record.command() != SD_COMMAND_STREAM_CHUNK)
+            return;
+        hostRx.receive(record.payload().data(), record.payload().size());
+        engine.ackStream(record.port(), hostRx);
+    });
+
+    // Host to device, the device's update() runs alongside the blocking sendStream()
+    auto hostSend = [&](uint8_t streamId, const std::vector<uint8_t> &data, uint16_t chunkSize) {
+        std::atomic<bool> done{false};
+        std::thread loop([&] {
+            while (!done) {
+                device.update();
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        });
+        bool ok = engine.sendStream(0, streamId, data.data(), (uint32_t) data.size(), chunkSize);
+        done = true;
+        loop.join();
+        return ok;
+    };
+
+    link.setRule([](bool toDevice, uint8_t cmd, unsigned index) {
+        if (!toDevice && cmd == SD_COMMAND_STREAM_ACK && index == 1)
+            return FAULT_DROP;
+        if (toDevice && cmd == SD_COMMAND_STREAM_CHUNK && index == 2)
+            return FAULT_CORRUPT;
+        return FAULT_NONE;
+    });
+    bool sent = hostSend(1, object, 64);
+    check(sent && deviceGot.data == object && device.streamStatus() == SD_STREAM_COMPLETE,
+          "host to device: lost ack and corrupted chunk are resent");
+
+    link.setRule(faultRule());
+    std::vector<uint8_t> small(object.begin(), object.begin() + 50);
+    deviceGot.completed = 0;
+    bool first = hostSend(2, small, 50);
+    bool second = hostSend(2, small, 50);
+    check(first && second && deviceGot.completed == 2, "host to device: same object twice reaches the sink twice");
+
+    // Device to host, the host's handler acks each chunk
+    deviceObject = &object;
+    link.setRule([](bool toDevice, uint8_t cmd, unsigned index) {
+        if (!toDevice && cmd == SD_COMMAND_STREAM_CHUNK && index == 1)
+            return FAULT_DROP;
+        if (toDevice && cmd == SD_COMMAND_STREAM_ACK && index == 3)
+            return FAULT_DROP;
+        if (!toDevice && cmd == SD_COMMAND_STREAM_CHUNK && index == 4)
+            return FAULT_CORRUPT;
+        return FAULT_NONE;
+    });
+    bool deviceSent = device.sendStream(3, (uint32_t) object.size(), objectSource, nullptr, 64);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    check(deviceSent && hostGot.data == object && hostGot.completed == 1 && hostRx.status() == SD_STREAM_COMPLETE,
+          "device to host: lost chunk, lost ack and corrupted chunk are resent");
+
+    link.setRule(faultRule());
+    bool deviceFirst = device.sendStream(4, 50, objectSource, nullptr, 64);
+    bool deviceSecond = device.sendStream(4, 50, objectSource, nullptr, 64);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    check(deviceFirst && deviceSecond && hostGot.completed == 3, "device to host: same object twice reaches the sink twice");
+
+    engine.stop();
+    link.stop();
+    close(deviceSlave);
+    close(deviceMaster);
+    close(hostSlave);
+    close(hostMaster);
+    printf("%s\n", failures ? "FAILED" : "all checks passed");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,78 @@
+/*
+ *  Mock Arduino core:
+ *      Just enough of the Arduino API to build the peripheral library on a Linux host.
+ *      HardwareSerial wraps a file descriptor (normally the slave side of a pty) so the
+ *      unmodified SerialDevicePeripheral code can be driven against the host engine.
+ */
+
+#ifndef MOCK_WPROGRAM_H_
+#define MOCK_WPROGRAM_H_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+inline unsigned long millis() {
+  using namespace std::chrono;
+  return (unsigned long) duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+inline unsigned long micros() {
+  using namespace std::chrono;
+  return (unsigned long) duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+class HardwareSerial {
+ public:
+  explicit HardwareSerial(int fd) : fd_(fd) {}
+
+  int available() {
+    if (rx_pos_ < rx_len_)
+      return (int) (rx_len_ - rx_pos_);
+    int count = 0;
+    if (ioctl(fd_, FIONREAD, &count) < 0)
+      return 0;
+    return count;
+  }
+
+  int read() {
+    if (rx_pos_ == rx_len_) {
+      ssize_t r = ::read(fd_, rx_buffer_, sizeof(rx_buffer_));
+      if (r <= 0)
+        return -1;
+      rx_pos_ = 0;
+      rx_len_ = (std::size_t) r;
+    }
+    return rx_buffer_[rx_pos_++];
+  }
+
+  size_t write(uint8_t c) {
+    return write(&c, 1);
+  }
+
+  size_t write(const uint8_t *buffer, size_t size) {
+    size_t written = 0;
+    while (written < size) {
+      ssize_t r = ::write(fd_, buffer + written, size - written);
+      if (r > 0) {
+        written += (size_t) r;
+      } else {
+        pollfd pfd{fd_, POLLOUT, 0};
+        if (poll(&pfd, 1, 1000) <= 0)
+          break;
+      }
+    }
+    return written;
+  }
+
+ private:
+  int fd_;
+  uint8_t rx_buffer_[256]{};
+  std::size_t rx_pos_{0};
+  std::size_t rx_len_{0};
+};
+
+#endif // MOCK_WPROGRAM_H_
@@ -0,0 +1,172 @@
+/*
+ *  CRC-CCITT (XMODEM) bulk backends:
+ *      High throughput versions of CRC16::calculate() for host side tools that verify large
+ *      amounts of recorded frames. Slicing-by-16 tables work on any CPU, on x86 a carry-less
+ *      multiply folding path is used when the CPU supports PCLMULQDQ (checked at run time).
+ *      Both are bit-exact with the byte at a time table in CRC16.
+ *
+ *      The tables take 8KB so this is only pulled in for non Arduino builds, see SerialDevice.hpp.
+ */
+
+#ifndef CRC16_FAST_HPP_
+#define CRC16_FAST_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__)) \
+ && !defined(SD_CRC16_NO_CLMUL)
+#define SD_CRC16_CLMUL
+#include <immintrin.h>
+#endif
+
+namespace rw {
+  namespace serial_device {
+    namespace crc_fast {
+
+      const uint16_t kPolynomial = 0x1021;
+      const size_t kSlicingMinLength = 16;
+      const size_t kClmulMinLength = 128;
+
+      typedef struct crcTables {
+          uint16_t slice[16][256];
+          // x^n mod P, used to fold 128-bit blocks forward by n bits
+          uint64_t fold_128;
+          uint64_t fold_192;
+          uint64_t fold_512;
+          uint64_t fold_576;
+          bool clmul;
+
+          crcTables() {
+            for (int dividend = 0; dividend < 256; ++dividend) {
+              uint16_t remainder = (uint16_t)(dividend << 8);
+              for (int bit = 8; bit > 0; --bit)
+                remainder = (remainder & 0x8000) ? (uint16_t)((remainder << 1) ^ kPolynomial) : (uint16_t)(remainder << 1);
+              slice[0][dividend] = remainder;
+            }
+            // slice[k][b] is the CRC of byte b followed by k zero bytes
+            for (int k = 1; k < 16; ++k)
+              for (int i = 0; i < 256; ++i)
+                slice[k][i] = (uint16_t)((slice[k - 1][i] << 8) ^ slice[0][slice[k - 1][i] >> 8]);
+
+            fold_128 = xPowModP(128);
+            fold_192 = xPowModP(192);
+            fold_512 = xPowModP(512);
+            fold_576 = xPowModP(576);
+          #ifdef SD_CRC16_CLMUL
+            __builtin_cpu_init();
+            clmul = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+          #else
+            clmul = false;
+          #endif
+          }
+
+          static uint64_t xPowModP(int n) {
+            uint32_t r = 1;
+            for (int i = 0; i < n; ++i) {
+              r <<= 1;
+              if (r & 0x10000)
+                r ^= 0x10000 | kPolynomial;
+            }
+            return r;
+          }
+      } crcTables;
+
+      inline const crcTables &tables() {
+        static const crcTables t;
+        return t;
+      }
+
+      inline uint16_t sliceBy16(uint16_t crc, const uint8_t *p, size_t len) {
+        const uint16_t (*t)[256] = tables().slice;
+        while (len >= 16) {
+          crc = t[15][p[0] ^ (crc >> 8)] ^ t[14][p[1] ^ (crc & 0xFF)] ^
+                t[13][p[2]] ^ t[12][p[3]] ^ t[11][p[4]] ^ t[10][p[5]] ^
+                t[9][p[6]] ^ t[8][p[7]] ^ t[7][p[8]] ^ t[6][p[9]] ^
+                t[5][p[10]] ^ t[4][p[11]] ^ t[3][p[12]] ^ t[2][p[13]] ^
+                t[1][p[14]] ^ t[0][p[15]];
+          p += 16;
+          len -= 16;
+        }
+        if (len >= 8) {
+          crc = t[7][p[0] ^ (crc >> 8)] ^ t[6][p[1] ^ (crc & 0xFF)] ^
+                t[5][p[2]] ^ t[4][p[3]] ^ t[3][p[4]] ^ t[2][p[5]] ^
+                t[1][p[6]] ^ t[0][p[7]];
+          p += 8;
+          len -= 8;
+        }
+        while (len--)
+          crc = (uint16_t)(t[0][*p++ ^ (crc >> 8)] ^ (crc << 8));
+        return crc;
+      }
+
+    #ifdef SD_CRC16_CLMUL
+      /*
+       *  Blocks are loaded byte reversed so bit i of the 128-bit lane is the coefficient of x^i,
+       *  the CRC is non-reflected so that is the message's natural bit order. Four accumulators
+       *  are folded forward 512 bits at a time, then merged and the last 16 bytes of state are
+       *  finished off with the tables along with any tail shorter than a block.
+       */
+      __attribute__((target("pclmul,ssse3")))
+      inline __m128i fold(__m128i acc, __m128i k) {
+        return _mm_xor_si128(_mm_clmulepi64_si128(acc, k, 0x11), _mm_clmulepi64_si128(acc, k, 0x00));
+      }
+
+      __attribute__((target("pclmul,ssse3")))
+      inline uint16_t clmul(uint16_t crc, const uint8_t *p, size_t len) {
+        const crcTables &t = tables();
+        const __m128i swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+        const __m128i k4 = _mm_set_epi64x((long long) t.fold_576, (long long) t.fold_512);
+        const __m128i k1 = _mm_set_epi64x((long long) t.fold_192, (long long) t.fold_128);
+
+        __m128i a0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 0)), swap);
+        __m128i a1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16)), swap);
+        __m128i a2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 32)), swap);
+        __m128i a3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 48)), swap);
+        a0 = _mm_xor_si128(a0, _mm_set_epi64x((long long)((uint64_t) crc << 48), 0));
+        p += 64;
+        len -= 64;
+
+        while (len >= 64) {
+          a0 = _mm_xor_si128(fold(a0, k4), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 0)), swap));
+          a1 = _mm_xor_si128(fold(a1, k4), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16)), swap));
+          a2 = _mm_xor_si128(fold(a2, k4), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 32)), swap));
+          a3 = _mm_xor_si128(fold(a3, k4), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 48)), swap));
+          p += 64;
+          len -= 64;
+        }
+
+        a1 = _mm_xor_si128(a1, fold(a0, k1));
+        a2 = _mm_xor_si128(a2, fold(a1, k1));
+        a3 = _mm_xor_si128(a3, fold(a2, k1));
+        while (len >= 16) {
+          a3 = _mm_xor_si128(fold(a3, k1), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) p), swap));
+          p += 16;
+          len -= 16;
+        }
+
+        uint8_t state[16];
+        _mm_storeu_si128((__m128i *) state, _mm_shuffle_epi8(a3, swap));
+        return sliceBy16(sliceBy16(0, state, 16), p, len);
+      }
+    #endif
+
+      inline uint16_t calculate(uint16_t crc, const uint8_t *p, size_t len) {
+      #ifdef SD_CRC16_CLMUL
+        if (len >= kClmulMinLength && tables().clmul)
+          return clmul(crc, p, len);
+      #endif
+        return sliceBy16(crc, p, len);
+      }
+
+      inline const char *backend() {
+      #ifdef SD_CRC16_CLMUL
+        if (tables().clmul)
+          return "pclmul folding";
+      #endif
+        return "slicing-by-16";
+      }
+    } // end namespace crc_fast
+  } // end namespace serial_device
+} // end namespace rw
+#endif // CRC16_FAST_HPP_
@@ -8,6 +8,7 @@
 #ifndef MIXED_DATA_TYPE_HPP_
 #define MIXED_DATA_TYPE_HPP_
 
+#include <stdint.h>
 #include <string>
 #include <vector>
 
@@ -32,6 +33,49 @@ namespace rw {
           std::string key;
       } dataStruct;
 
+      // FNV-1a, used to match keys / string values without building temporary strings
+      inline uint32_t hashBytes(const uint8_t *bytes, std::size_t size)
+      {
+          uint32_t hash = 2166136261u;
+          for (std::size_t i = 0; i < size; ++i)
+          {
+              hash ^= bytes[i];
+              hash *= 16777619u;
+          }
+          return hash;
+      }
+
+      // Read only view of a single value, points into the container it came from
+      typedef struct fieldView {
+          uint8_t data_type{};
+          const uint8_t *data{};
+          std::size_t size{};
+
+          template <typename T>
+          T as() const
+          {
+              T value{};
+              if (data_type != DATA_TYPE_STRING && sizeof(T) == size)
+              {
+                  auto* p = reinterpret_cast<uint8_t*>(&value);
+                  for (std::size_t i = 0; i != sizeof(T); ++i)
+                      p[i] = data[i];
+              }
+              return value;
+          }
+
+          bool equals(const char *str) const
+          {
+              std::size_t i = 0;
+              for (; i < size; ++i)
+              {
+                  if (str[i] == '\0' || (uint8_t)str[i] != data[i])
+                      return false;
+              }
+              return str[i] == '\0';
+          }
+      } fieldView;
+
       class MixedDataType {
       public:
           MixedDataType() = default;
@@ -251,11 +295,53 @@ namespace rw {
               return -1;
           }
 
+          // Looks up a value without allocating, the view is valid until the data changes
+          bool field(const char *key, fieldView &out) const
+          {
+              for (const auto& d : data_)
+              {
+                  std::size_t i = 0;
+                  while (i < d.key.size() && key[i] != '\0' && key[i] == d.key[i])
+                      i++;
+                  if (i == d.key.size() && key[i] == '\0')
+                  {
+                      out = view(d);
+                      return true;
+                  }
+              }
+              return false;
+          }
+
+          std::size_t fieldCount() const
+          {
+              return data_.size();
+          }
+
+          const dataStruct &fieldAt(std::size_t index) const
+          {
+              return data_.at(index);
+          }
+
+          static fieldView view(const dataStruct &d)
+          {
+              fieldView v;
+              v.data_type = d.data_type;
+              v.size = d.data.size();
+              v.data = v.size > 0 ? &d.data[0] : nullptr;
+              return v;
+          }
+
           void clearData()
           {
               data_.clear();
           }
 
+          // Exchanges contents with another container, only the vector pointers move
+          void swapData(MixedDataType &other)
+          {
+              data_.swap(other.data_);
+          }
+
           template <typename T>
           T get(const std::string &key)
           {
@@ -372,6 +458,16 @@ namespace rw {
               }
           }
       }; // End MixedDataType Class
+
+      // MixedDataType with the wire format exposed, for building / decoding packets
+      // without touching a device's own data
+      class DataPacket : public MixedDataType {
+      public:
+          DataPacket() = default;
+          ~DataPacket() override = default;
+          using MixedDataType::serialize;
+          using MixedDataType::deserialize;
+      }; // End DataPacket Class
   } // End mdt namespace
 } // End rw namespace
 #endif // MIXED_DATA_TYPE_HPP_
@@ -1,18 +1,78 @@
 #ifndef SERIAL_DEVICE_HPP_
 #define SERIAL_DEVICE_HPP_
 
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Host builds get the table sliced / carry-less multiply CRC backend, define SD_CRC16_BYTEWISE
+// to keep the small byte at a time table everywhere
+#if !defined(ARDUINO) && !defined(SD_CRC16_BYTEWISE)
+#define SD_CRC16_FAST
+#include "CRC16Fast.hpp"
+#endif
+
 namespace rw {
   namespace serial_device {
 
     const uint32_t kSerialNumberAny = 0;
 
+    const uint8_t kPacketHeader = 0xAA;
+    const uint8_t kPacketId = 0xBB;
+    // Same framing with a 4 byte device micros() timestamp between cmd and payload
+    const uint8_t kPacketIdTimestamp = 0xBC;
+    const uint8_t kPacketStop = 0xDD;
+
     typedef enum kSudCommandType {
       SD_COMMAND_GET_INFO = 0x50,
+      SD_COMMAND_GET_STATS = 0x53,
+      SD_COMMAND_STREAM_ACK = 0x61,
+      SD_COMMAND_STREAM_CHUNK = 0x63,
       SD_COMMAND_SEND_DATA = 0x64,
       SD_COMMAND_SEND_INFO = 0x69,
-	  SD_COMMAND_STOP_DATA = 0x72
+      SD_COMMAND_PING_REPLY = 0x6F,
+      SD_COMMAND_PING = 0x70,
+	  SD_COMMAND_STOP_DATA = 0x72,
+      SD_COMMAND_SEND_STATS = 0x73
     } kSudCommandType;
 
+    const uint8_t kHistogramBuckets = 20;
+
+    /*
+     *  Latency histogram:
+     *      Bucket i counts samples in [2^i, 2^(i+1)) microseconds (bucket 0 also takes 0),
+     *      the last bucket takes everything from about half a second up.
+     */
+    typedef struct latencyHistogram {
+      uint32_t buckets[kHistogramBuckets]{};
+      uint32_t count{};
+      uint32_t min{};
+      uint32_t max{};
+
+      void record(uint32_t us) {
+        uint8_t bucket = 0;
+        uint32_t v = us;
+        while (v > 1 && bucket < kHistogramBuckets - 1) {
+          v >>= 1;
+          bucket++;
+        }
+        buckets[bucket]++;
+        if (count == 0 || us < min)
+          min = us;
+        if (us > max)
+          max = us;
+        count++;
+      }
+
+      void reset() {
+        for (uint8_t i = 0; i < kHistogramBuckets; i++)
+          buckets[i] = 0;
+        count = 0;
+        min = 0;
+        max = 0;
+      }
+    } latencyHistogram;
+
     typedef struct deviceDescriptor {
       uint16_t class_id;
       uint16_t type_id;
@@ -47,9 +107,17 @@ namespace rw {
       ~CRC16() = default;
 
       uint16_t calculate(unsigned char const message[], int startByte, int endByte) {
+        return calculate(message, startByte, endByte, 0);
+      }
+
+      // Continues a running CRC, pass the previous result as remainder
+      uint16_t calculate(unsigned char const message[], int startByte, int endByte, uint16_t remainder) {
         uint8_t data;
-        uint16_t remainder = 0;
 
+      #ifdef SD_CRC16_FAST
+        if (endByte - startByte >= (int) crc_fast::kSlicingMinLength)
+          return crc_fast::calculate(remainder, message + startByte, (size_t)(endByte - startByte));
+      #endif
         for (int byte = startByte; byte < endByte; ++byte) {
           data = message[byte] ^ (remainder >> (width_ - 8));
           remainder = crc_table_[data] ^ (remainder << 8);
@@ -65,6 +133,383 @@ namespace rw {
       uint16_t top_bit_;
 
     };
+
+    typedef enum kParseResult {
+      SD_PARSE_INCOMPLETE,
+      SD_PARSE_COMPLETE,
+      SD_PARSE_CRC_ERROR,
+      SD_PARSE_FRAME_ERROR
+    } kParseResult;
+
+    /*
+     *  Incremental packet parser:
+     *      Feed it one byte at a time as it arrives, it never blocks waiting for the
+     *      rest of a packet. Shared by the peripheral and host side so both agree on
+     *      the framing:  AA BB [size hi] [size lo] [cmd] [payload] [crc hi] [crc lo] DD
+     *      where size counts cmd + payload + crc + stop byte. Timestamped packets use BC in
+     *      place of BB and carry a big-endian uint32 timestamp after cmd (counted in size,
+     *      not covered by the CRC, same as the cmd byte).
+     */
+    class PacketParser {
+     public:
+      explicit PacketParser(CRC16 &crc) : crc_(crc) {}
+      ~PacketParser() = default;
+
+      kParseResult parse(uint8_t data) {
+        switch (state_) {
+          case STATE_HEADER:
+            if (data == kPacketHeader)
+              state_ = STATE_ID;
+            break;
+          case STATE_ID:
+            if (data == kPacketId || data == kPacketIdTimestamp) {
+              has_timestamp_ = data == kPacketIdTimestamp;
+              state_ = STATE_SIZE_HI;
+            }
+            else if (data != kPacketHeader)
+              state_ = STATE_HEADER;
+            break;
+          case STATE_SIZE_HI:
+            size_ = (uint16_t)(data << 8);
+            state_ = STATE_SIZE_LO;
+            break;
+          case STATE_SIZE_LO:
+            size_ |= data;
+            if (size_ < (has_timestamp_ ? 8 : 4)) {
+              state_ = STATE_HEADER;
+              return SD_PARSE_FRAME_ERROR;
+            }
+            state_ = STATE_CMD;
+            break;
+          case STATE_CMD:
+            cmd_ = data;
+            payload_.clear();
+            timestamp_ = 0;
+            remaining_ = size_ - (has_timestamp_ ? 8 : 4);
+            if (has_timestamp_)
+              state_ = STATE_TIMESTAMP;
+            else
+              state_ = remaining_ > 0 ? STATE_PAYLOAD : STATE_CRC_HI;
+            break;
+          case STATE_TIMESTAMP:
+            timestamp_ = (timestamp_ << 8) | data;
+            if (++timestamp_bytes_ == 4) {
+              timestamp_bytes_ = 0;
+              state_ = remaining_ > 0 ? STATE_PAYLOAD : STATE_CRC_HI;
+            }
+            break;
+          case STATE_PAYLOAD:
+            payload_.push_back(data);
+            if (--remaining_ == 0)
+              state_ = STATE_CRC_HI;
+            break;
+          case STATE_CRC_HI:
+            packet_crc_ = (uint16_t)(data << 8);
+            state_ = STATE_CRC_LO;
+            break;
+          case STATE_CRC_LO:
+            packet_crc_ |= data;
+            state_ = STATE_STOP;
+            break;
+          case STATE_STOP:
+            state_ = STATE_HEADER;
+            if (data != kPacketStop)
+              return SD_PARSE_FRAME_ERROR;
+        #ifdef ARDUINO_STL_USE_VECTOR_BEGIN
+            if (crc_.calculate((const unsigned char *)payload_.begin(), 0, payload_.size()) != packet_crc_)
+        #else
+            if (crc_.calculate((const unsigned char *) payload_.data(), 0, payload_.size()) != packet_crc_)
+        #endif
+              return SD_PARSE_CRC_ERROR;
+            return SD_PARSE_COMPLETE;
+        }
+        return SD_PARSE_INCOMPLETE;
+      }
+
+      void reset() {
+        state_ = STATE_HEADER;
+        timestamp_bytes_ = 0;
+      }
+
+      uint8_t command() const {
+        return cmd_;
+      }
+
+      // Sender's micros() when the packet went out, only valid if hasTimestamp()
+      bool hasTimestamp() const {
+        return has_timestamp_;
+      }
+
+      uint32_t timestamp() const {
+        return timestamp_;
+      }
+
+      const std::vector<uint8_t> &payload() const {
+        return payload_;
+      }
+
+      std::vector<uint8_t> &payload() {
+        return payload_;
+      }
+
+     private:
+      typedef enum kParseState {
+        STATE_HEADER,
+        STATE_ID,
+        STATE_SIZE_HI,
+        STATE_SIZE_LO,
+        STATE_CMD,
+        STATE_TIMESTAMP,
+        STATE_PAYLOAD,
+        STATE_CRC_HI,
+        STATE_CRC_LO,
+        STATE_STOP
+      } kParseState;
+
+      CRC16 &crc_;
+      std::vector<uint8_t> payload_;
+      uint8_t state_{STATE_HEADER};
+      uint8_t cmd_{};
+      bool has_timestamp_{};
+      uint8_t timestamp_bytes_{};
+      uint32_t timestamp_{};
+      uint16_t size_{};
+      uint16_t remaining_{};
+      uint16_t packet_crc_{};
+    };
+
+    /*
+     *  Streaming transfer:
+     *      Objects bigger than one packet are sent as a run of SD_COMMAND_STREAM_CHUNK packets,
+     *      each payload is a 13 byte big-endian header followed by the chunk's bytes:
+     *          [stream id] [seq 2] [offset 4] [total size 4] [running crc 2] [data...]
+     *      The running CRC covers the whole object from offset 0 to the end of the chunk.
+     *      A chunk at offset 0 starts a new stream. The receiver answers every chunk with
+     *      SD_COMMAND_STREAM_ACK:  [stream id] [seq 2] [status] [bytes received 4]
+     *
+     *      The sender waits for each ack before sending the next chunk. If none arrives within
+     *      kStreamAckTimeoutMs, or the ack says SD_STREAM_ERROR, it sends again from the ack's
+     *      bytes received, giving up after kStreamRetries attempts in a row. SD_STREAM_ABORTED
+     *      (the sink refused the data) ends the transfer.
+     *
+     *      A resend keeps its seq, and the receiver just acks a repeat of the last chunk it took.
+     *      Senders carry seq on from their previous transfer (never starting again at 0) so a
+     *      new transfer of the same object is not mistaken for one of those repeats.
+     *
+     *      The receiving device's parser holds a whole chunk in RAM and update() has to keep
+     *      draining the UART (64 bytes on an AVR) while it arrives, so keep chunks to
+     *      kStreamChunkSize when talking to small boards.
+     */
+    const uint8_t kStreamHeaderSize = 13;
+    const uint8_t kStreamAckSize = 8;
+    const uint16_t kStreamChunkSize = 128;
+    const uint16_t kStreamAckTimeoutMs = 500;
+    const uint8_t kStreamRetries = 3;
+
+    typedef enum kStreamStatus {
+      SD_STREAM_IDLE,
+      SD_STREAM_RECEIVING,
+      SD_STREAM_COMPLETE,
+      SD_STREAM_ERROR,
+      SD_STREAM_ABORTED
+    } kStreamStatus;
+
+    typedef struct streamChunk {
+      uint8_t stream_id;
+      uint16_t seq;
+      uint32_t offset;
+      uint32_t total;
+      uint16_t crc;
+      const uint8_t *data;
+      uint16_t size;
+      bool last;
+    } streamChunk;
+
+    typedef struct streamAck {
+      uint8_t stream_id;
+      uint16_t seq;
+      kStreamStatus status;
+      uint32_t received;
+    } streamAck;
+
+    // Receives each chunk as it arrives, return false to abort the transfer
+    typedef bool (*streamSink)(const streamChunk &chunk, void *context);
+    // Fills buffer with the size bytes of the object starting at offset and returns size, anything less aborts.
+    // A chunk that has to be resent asks for the same offset again
+    typedef uint16_t (*streamSource)(uint32_t offset, uint8_t *buffer, uint16_t size, void *context);
+
+    inline void writeStreamHeader(uint8_t *out, const streamChunk &chunk) {
+      out[0] = chunk.stream_id;
+      out[1] = chunk.seq >> 8;
+      out[2] = chunk.seq & 0xFF;
+      for (int i = 0; i < 4; i++) {
+        out[3 + i] = (chunk.offset >> (24 - 8 * i)) & 0xFF;
+        out[7 + i] = (chunk.total >> (24 - 8 * i)) & 0xFF;
+      }
+      out[11] = chunk.crc >> 8;
+      out[12] = chunk.crc & 0xFF;
+    }
+
+    inline bool readStreamHeader(const uint8_t *in, size_t size, streamChunk &chunk) {
+      if (size < kStreamHeaderSize || size - kStreamHeaderSize > 0xFFFF)
+        return false;
+      chunk.stream_id = in[0];
+      chunk.seq = (uint16_t)((in[1] << 8) | in[2]);
+      chunk.offset = 0;
+      chunk.total = 0;
+      for (int i = 0; i < 4; i++) {
+        chunk.offset = (chunk.offset << 8) | in[3 + i];
+        chunk.total = (chunk.total << 8) | in[7 + i];
+      }
+      chunk.crc = (uint16_t)((in[11] << 8) | in[12]);
+      chunk.data = in + kStreamHeaderSize;
+      chunk.size = (uint16_t)(size - kStreamHeaderSize);
+      chunk.last = false;
+      return true;
+    }
+
+    inline void writeStreamAck(uint8_t *out, const streamAck &ack) {
+      out[0] = ack.stream_id;
+      out[1] = ack.seq >> 8;
+      out[2] = ack.seq & 0xFF;
+      out[3] = (uint8_t) ack.status;
+      for (int i = 0; i < 4; i++)
+        out[4 + i] = (ack.received >> (24 - 8 * i)) & 0xFF;
+    }
+
+    inline bool readStreamAck(const uint8_t *in, size_t size, streamAck &ack) {
+      if (size < kStreamAckSize || in[3] > SD_STREAM_ABORTED)
+        return false;
+      ack.stream_id = in[0];
+      ack.seq = (uint16_t)((in[1] << 8) | in[2]);
+      ack.status = (kStreamStatus) in[3];
+      ack.received = 0;
+      for (int i = 0; i < 4; i++)
+        ack.received = (ack.received << 8) | in[4 + i];
+      return true;
+    }
+
+    /*
+     *  Stream receiver:
+     *      Checks each chunk follows on from the last one and that the running CRC matches,
+     *      then hands it to the sink. Nothing is buffered beyond the packet being processed.
+     *      After SD_STREAM_ERROR a chunk of the same stream starting at received() picks the
+     *      transfer up again, a repeat of the last chunk (its ack was lost) is just acked again.
+     */
+    class StreamReceiver {
+     public:
+      explicit StreamReceiver(CRC16 &crc) : crc_(crc) {}
+      ~StreamReceiver() = default;
+
+      void setSink(streamSink sink, void *context) {
+        sink_ = sink;
+        context_ = context;
+      }
+
+      kStreamStatus receive(const uint8_t *payload, size_t size) {
+        streamChunk chunk;
+        if (!readStreamHeader(payload, size, chunk))
+          return fail();
+        last_id_ = chunk.stream_id;
+        last_seq_ = chunk.seq;
+        if (status_ != SD_STREAM_IDLE && status_ != SD_STREAM_ABORTED && received_ > 0 && sameStream(chunk)
+            && chunk.seq == (uint16_t)(next_seq_ - 1) && chunk.offset + chunk.size == received_ && chunk.crc == running_crc_) {
+          status_ = received_ == total_ ? SD_STREAM_COMPLETE : SD_STREAM_RECEIVING;
+          return status_;
+        }
+        if (chunk.offset == 0) {
+          status_ = SD_STREAM_RECEIVING;
+          stream_id_ = chunk.stream_id;
+          next_seq_ = chunk.seq;
+          total_ = chunk.total;
+          received_ = 0;
+          running_crc_ = 0;
+        }
+        else if (status_ == SD_STREAM_ERROR && sameStream(chunk) && chunk.offset == received_) {
+          status_ = SD_STREAM_RECEIVING;
+          next_seq_ = chunk.seq;
+        }
+        if (status_ != SD_STREAM_RECEIVING || chunk.stream_id != stream_id_ || chunk.seq != next_seq_
+            || chunk.offset != received_ || chunk.total != total_ || chunk.size > total_ - received_)
+          return fail();
+
+        // Only kept once the chunk checks out, so a bad one can be resent from received()
+        uint16_t crc = crc_.calculate(chunk.data, 0, chunk.size, running_crc_);
+        if (crc != chunk.crc)
+          return fail();
+
+        running_crc_ = crc;
+        received_ += chunk.size;
+        next_seq_++;
+        chunk.last = received_ == total_;
+        if (sink_ == nullptr || !sink_(chunk, context_)) {
+          status_ = SD_STREAM_ABORTED;
+          return status_;
+        }
+        if (chunk.last)
+          status_ = SD_STREAM_COMPLETE;
+        return status_;
+      }
+
+      // Answer to the last chunk passed to receive()
+      streamAck ack() const {
+        streamAck a;
+        a.stream_id = last_id_;
+        a.seq = last_seq_;
+        a.status = status_;
+        a.received = received_;
+        return a;
+      }
+
+      void reset() {
+        status_ = SD_STREAM_IDLE;
+        received_ = 0;
+      }
+
+      kStreamStatus status() const {
+        return status_;
+      }
+
+      uint8_t streamId() const {
+        return stream_id_;
+      }
+
+      uint16_t lastSeq() const {
+        return last_seq_;
+      }
+
+      uint32_t received() const {
+        return received_;
+      }
+
+      uint32_t total() const {
+        return total_;
+      }
+
+     private:
+      bool sameStream(const streamChunk &chunk) const {
+        return chunk.stream_id == stream_id_ && chunk.total == total_;
+      }
+
+      kStreamStatus fail() {
+        // Once the sink has refused the data only a new stream starts things again
+        if (status_ != SD_STREAM_ABORTED)
+          status_ = SD_STREAM_ERROR;
+        return status_;
+      }
+
+      CRC16 &crc_;
+      streamSink sink_{};
+      void *context_{};
+      kStreamStatus status_{SD_STREAM_IDLE};
+      uint8_t stream_id_{};
+      uint8_t last_id_{};
+      uint16_t next_seq_{};
+      uint16_t last_seq_{};
+      uint16_t running_crc_{};
+      uint32_t total_{};
+      uint32_t received_{};
+    };
   } // end namespace serial_device
 } // end namespace rw
 #endif // SERIAL_DEVICE_HPP_
\ No newline at end of file
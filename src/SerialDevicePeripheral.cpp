@@ -1,8 +1,43 @@
 #include "SerialDevicePeripheral.hpp"
 
+namespace {
+    // First entry not less than (key_hash, value_hash), entries are kept sorted on both
+    size_t lowerBound(const std::vector<rw::serial_device::dispatchEntry> &entries, uint32_t key_hash, uint32_t value_hash) {
+        size_t lo = 0;
+        size_t hi = entries.size();
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            const rw::serial_device::dispatchEntry &e = entries[mid];
+            if (e.key_hash < key_hash || (e.key_hash == key_hash && e.value_hash < value_hash))
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+    bool sameBytes(const char *str, uint8_t size, const uint8_t *bytes, size_t bytesSize) {
+        if (size != bytesSize)
+            return false;
+        for (uint8_t i = 0; i < size; i++) {
+            if ((uint8_t) str[i] != bytes[i])
+                return false;
+        }
+        return true;
+    }
+
+    uint8_t stringSize(const char *str) {
+        size_t size = 0;
+        while (str[size] != '\0' && size < 255)
+            size++;
+        return (uint8_t) size;
+    }
+}
+
 namespace rw {
     namespace serial_device {
-        SerialDevicePeripheral::SerialDevicePeripheral(HardwareSerial *serial_device) {
+        SerialDevicePeripheral::SerialDevicePeripheral(HardwareSerial *serial_device)
+            : parser_(crc_), stream_(crc_) {
             device_description_.class_id = 1;
             device_description_.type_id = 1;
             device_description_.serial = 1;
@@ -14,12 +49,28 @@ namespace rw {
             serial_device_ = serial_device;
             data_available_ = false;
 			data_error_ = false;
-            header_byte_ = 0xAA;
-            packet_id_ = 0xBB;
-            stop_byte_ = 0xDD;
+            stop_data_ = false;
+            stop_timeout_ = 0;
+            timestamps_ = false;
+            polled_ = false;
+            last_poll_us_ = 0;
+            ack_pending_ = false;
+            rx_us_ = 0;
+            rx_pending_ = false;
+            reader_active_ = false;
+            rx_held_valid_ = false;
+            rx_stalled_ = false;
+            dropped_packets_ = 0;
+            stream_seq_ = 0;
+            stream_ack_valid_ = false;
+            frame_version_ = 0;
+            header_byte_ = kPacketHeader;
+            packet_id_ = kPacketId;
+            stop_byte_ = kPacketStop;
         }
 
-        SerialDevicePeripheral::SerialDevicePeripheral(HardwareSerial *serial_device, const deviceDescriptor &desc) {
+        SerialDevicePeripheral::SerialDevicePeripheral(HardwareSerial *serial_device, const deviceDescriptor &desc)
+            : parser_(crc_), stream_(crc_) {
             device_description_.class_id = desc.class_id;
             device_description_.type_id = desc.type_id;
             device_description_.serial = desc.serial;
@@ -31,9 +82,24 @@ namespace rw {
             serial_device_ = serial_device;
             data_available_ = false;
 			data_error_ = false;
-            header_byte_ = 0xAA;
-            packet_id_ = 0xBB;
-            stop_byte_ = 0xDD;
+            stop_data_ = false;
+            stop_timeout_ = 0;
+            timestamps_ = false;
+            polled_ = false;
+            last_poll_us_ = 0;
+            ack_pending_ = false;
+            rx_us_ = 0;
+            rx_pending_ = false;
+            reader_active_ = false;
+            rx_held_valid_ = false;
+            rx_stalled_ = false;
+            dropped_packets_ = 0;
+            stream_seq_ = 0;
+            stream_ack_valid_ = false;
+            frame_version_ = 0;
+            header_byte_ = kPacketHeader;
+            packet_id_ = kPacketId;
+            stop_byte_ = kPacketStop;
         }
 
         SerialDevicePeripheral::~SerialDevicePeripheral() = default;
@@ -97,65 +163,122 @@ namespace rw {
         }
 
         void SerialDevicePeripheral::update() {
-            if (serial_device_->available()) {
-                uint8_t data = serial_device_->read();
-                if (data == header_byte_) {
-                    data = serial_device_->read();
-                    if (data == packet_id_) {
-                        in_packet_.clear();
-                        uint8_t b1 = serial_device_->read();
-                        uint8_t b2 = serial_device_->read();
-                        uint16_t pSize = (b1 << 8) + b2;
-                        uint8_t cmd = serial_device_->read();
-                        for (int i = 0; i < pSize - 4; i++) {
-                            in_packet_.push_back(serial_device_->read());
-                        }
-                        b1 = serial_device_->read();
-                        b2 = serial_device_->read();
-                        uint8_t stopByte = serial_device_->read();
-                        uint16_t packCRC16 = (b1 << 8) + b2;
-                        //serial_device_->println(packCRC16);
-
-                        // Check CRC
-        #ifdef ARDUINO_STL_USE_VECTOR_BEGIN
-                        uint16_t calcCRC16 = crc_.calculate((const unsigned char*)in_packet_.begin(), 0, in_packet_.size());
-        #else
-                        uint16_t calcCRC16 = crc_.calculate((const unsigned char *) in_packet_.data(), 0, in_packet_.size());
-        #endif
-                        if (calcCRC16 != packCRC16) {
-                            data_available_ = false;
-							data_error_ = true;
-                            return;
-                        }
-						data_error_ = false;
-                        if (stopByte == stop_byte_) {
-                            if (cmd == (uint8_t) SD_COMMAND_GET_INFO) {
-                                sendInfoPacket();
-                                data_available_ = false;
-                                return;
-                            }
-							else if (cmd == (uint8_t)SD_COMMAND_STOP_DATA)
-							{
-								stop_data_ = true;
-								stop_timeout_ = millis();
-							}
-							else if (cmd == (uint8_t) SD_COMMAND_SEND_DATA) {
-                                if (in_packet_.size() > 0) {
-                                    deserialize(in_packet_);
-                                    data_available_ = true;
-                                    data_read_ = false;
-                                    return;
-                                }
-                            }
-                        }
-                    }
-                }
-            } else {
+            uint32_t now = micros();
+            if (polled_)
+                poll_histogram_.record(now - last_poll_us_);
+            polled_ = true;
+            last_poll_us_ = now;
+            drainHeldData();
+
+            if (!serial_device_->available()) {
                 if (data_read_ == true)
                     data_available_ = false;
+                return;
+            }
+            // Two data packets already queued behind the one the app is reading, the third
+            // is still sitting in the parser so leave the rest in the serial buffer for now
+            if (rx_stalled_)
+                return;
+            // Only consume what has already arrived, a partial packet is picked up
+            // again on the next call instead of blocking here for the rest of it
+            while (serial_device_->available()) {
+                if (handleByte((uint8_t) serial_device_->read()))
+                    return;
+            }
+        }
+
+        bool SerialDevicePeripheral::handleByte(uint8_t byte) {
+            // Returns true once the byte finished a packet (or failed one)
+            kParseResult result = parser_.parse(byte);
+            if (result == SD_PARSE_CRC_ERROR) {
+                data_available_ = false;
+                data_error_ = true;
+                return true;
+            }
+            if (result != SD_PARSE_COMPLETE)
+                return false;
+
+            data_error_ = false;
+            rx_us_ = micros();
+            uint8_t cmd = parser_.command();
+            // Only commands update() answers itself are timed, their reply is the ack.
+            // Data packets are left out so the app's own send rate doesn't end up in here
+            ack_pending_ = cmd == (uint8_t) SD_COMMAND_GET_INFO || cmd == (uint8_t) SD_COMMAND_PING
+                || cmd == (uint8_t) SD_COMMAND_GET_STATS || cmd == (uint8_t) SD_COMMAND_STREAM_CHUNK;
+            if (cmd == (uint8_t) SD_COMMAND_GET_INFO) {
+                sendInfoPacket();
+                data_available_ = false;
+            }
+            else if (cmd == (uint8_t) SD_COMMAND_PING) {
+                sendPingReply();
+            }
+            else if (cmd == (uint8_t) SD_COMMAND_GET_STATS) {
+                sendStatsPacket();
+            }
+            else if (cmd == (uint8_t) SD_COMMAND_STREAM_CHUNK) {
+                const std::vector<uint8_t> &payload = parser_.payload();
+                stream_.receive(payload.size() > 0 ? &payload[0] : nullptr, payload.size());
+                sendStreamAck();
+            }
+            else if (cmd == (uint8_t) SD_COMMAND_STREAM_ACK) {
+                // Picked up by sendStream() while it waits
+                const std::vector<uint8_t> &payload = parser_.payload();
+                stream_ack_valid_ = payload.size() > 0 && readStreamAck(&payload[0], payload.size(), stream_ack_);
+            }
+            else if (cmd == (uint8_t)SD_COMMAND_STOP_DATA)
+            {
+                stop_data_ = true;
+                stop_timeout_ = millis();
+            }
+            else if (cmd == (uint8_t) SD_COMMAND_SEND_DATA) {
+                if (parser_.payload().size() > 0) {
+                    // Control commands keep flowing while the app hasn't picked up the
+                    // last packet, only further data packets are held back behind it.
+                    // sendStream() gets here without going through update(), so move up
+                    // anything still held first or this packet would jump ahead of it
+                    drainHeldData();
+                    if (!rx_pending_ || !reader_active_)
+                        receiveData(parser_.payload());
+                    else if (!rx_held_valid_) {
+                        rx_held_.swap(parser_.payload());
+                        rx_held_valid_ = true;
+                    }
+                    else
+                        rx_stalled_ = true;
+                }
+            }
+            return true;
+        }
+
+        void SerialDevicePeripheral::receiveData(const std::vector<uint8_t> &payload) {
+            // Decode into the back buffer, available() publishes it unless
+            // a registered handler takes it first
+            rx_back_.deserialize(payload);
+            if (dispatch_.empty() || !dispatch(rx_back_))
+                rx_pending_ = true;
+        }
+
+        void SerialDevicePeripheral::drainHeldData() {
+            // Move queued data packets up once available() has freed the back buffer
+            while (!rx_pending_ && rx_held_valid_) {
+                rx_held_valid_ = false;
+                receiveData(rx_held_);
+                if (rx_stalled_) {
+                    rx_held_.swap(parser_.payload());
+                    rx_held_valid_ = true;
+                    rx_stalled_ = false;
+                }
             }
         }
 
+        void SerialDevicePeripheral::dropOldestData() {
+            // Throw away the packet waiting for available() so the queue moves up a place
+            // and the parser is free again
+            rx_pending_ = false;
+            dropped_packets_++;
+            drainHeldData();
+        }
+
         void SerialDevicePeripheral::sendPacket(kSudCommandType cmd) {
 			if (stop_data_)
 			{
@@ -164,34 +287,116 @@ namespace rw {
 				else
 					stop_data_ = false;
 			}
+            beginPacket(cmd);
+            serialize(out_packet_);
+            endPacket();
+        }
+
+        void SerialDevicePeripheral::sendInfoPacket() {
+            reply_.clearData();
+            reply_.add("class", device_description_.class_id);
+            reply_.add("type", device_description_.type_id);
+            reply_.add("serial", device_description_.serial);
+            reply_.add("v1", device_description_.version_major);
+            reply_.add("v2", device_description_.version_minor);
+            reply_.add("v3", device_description_.version_revision);
+            reply_.add("name", device_description_.name);
+            reply_.add("info", device_description_.info);
+            beginPacket(SD_COMMAND_SEND_INFO);
+            reply_.serialize(out_packet_);
+            endPacket();
+        }
+
+        void SerialDevicePeripheral::sendPingReply() {
+            // Echo whatever the host sent (normally just its "tok" token) plus our timestamps
+            reply_.clearData();
+            if (parser_.payload().size() > 0)
+                reply_.deserialize(parser_.payload());
+            reply_.add("rx", (uint32_t) rx_us_);
+            reply_.add("tx", (uint32_t) micros());
+            beginPacket(SD_COMMAND_PING_REPLY);
+            reply_.serialize(out_packet_);
+            endPacket();
+        }
+
+        void SerialDevicePeripheral::sendStatsPacket() {
+            // Only non-empty buckets are sent, missing ones are zero
+            const latencyHistogram *histograms[2] = {&poll_histogram_, &ack_histogram_};
+            const char prefix[2] = {'p', 'a'};
+            reply_.clearData();
+            for (uint8_t h = 0; h < 2; h++) {
+                std::string key(1, prefix[h]);
+                reply_.add(key + "n", histograms[h]->count);
+                reply_.add(key + "min", histograms[h]->min);
+                reply_.add(key + "max", histograms[h]->max);
+                for (uint8_t i = 0; i < kHistogramBuckets; i++) {
+                    if (histograms[h]->buckets[i] == 0)
+                        continue;
+                    std::string bucketKey = key;
+                    if (i >= 10)
+                        bucketKey += (char) ('0' + i / 10);
+                    bucketKey += (char) ('0' + i % 10);
+                    reply_.add(bucketKey, histograms[h]->buckets[i]);
+                }
+            }
+            beginPacket(SD_COMMAND_SEND_STATS);
+            reply_.serialize(out_packet_);
+            endPacket();
+        }
+
+        void SerialDevicePeripheral::sendStreamAck() {
+            beginPacket(SD_COMMAND_STREAM_ACK);
+            size_t header = out_packet_.size();
+            out_packet_.resize(header + kStreamAckSize);
+            writeStreamAck(&out_packet_[header], stream_.ack());
+            endPacket();
+        }
+
+        void SerialDevicePeripheral::beginPacket(uint8_t cmd) {
             out_packet_.clear();
-            uint16_t pSize = 0;
             cmd_ = cmd;
             out_packet_.push_back(header_byte_);
-            out_packet_.push_back(packet_id_);
+            out_packet_.push_back(timestamps_ ? kPacketIdTimestamp : packet_id_);
             out_packet_.push_back(0); // Place holder for packet size
             out_packet_.push_back(0); // Place holder for packet size
             out_packet_.push_back(cmd_);
-            pSize++;
-            pSize += serialize(out_packet_);
+            if (timestamps_) {
+                for (int i = 0; i < 4; i++)
+                    out_packet_.push_back(0); // Place holder for timestamp
+            }
+        }
+
+        void SerialDevicePeripheral::endPacket() {
+            int payloadStart = timestamps_ ? 9 : 5;
             out_packet_.push_back(0); // Place holder for CRC-16
             out_packet_.push_back(0); // Place holder for CRC-16
             out_packet_.push_back(stop_byte_);
-            pSize += 3;
+            uint16_t pSize = out_packet_.size() - 4;
             out_packet_.at(2) = pSize >> 8;
             out_packet_.at(3) = pSize & 0xFF;
 
             // Calculate and insert CRC16
         #ifdef ARDUINO_STL_USE_VECTOR_BEGIN
-            uint16_t calcCRC16 = crc_.calculate((const unsigned char *)out_packet_.begin(), 5, out_packet_.size() - 3);
+            uint16_t calcCRC16 = crc_.calculate((const unsigned char *)out_packet_.begin(), payloadStart, out_packet_.size() - 3);
         #else
-            uint16_t calcCRC16 = crc_.calculate((const unsigned char *) out_packet_.data(), 5, out_packet_.size() - 3);
+            uint16_t calcCRC16 = crc_.calculate((const unsigned char *) out_packet_.data(), payloadStart, out_packet_.size() - 3);
         #endif
-            //Serial.print("CRC: ");
-            //Serial.println(calcCRC16);
             out_packet_.at(out_packet_.size() - 3) = calcCRC16 >> 8;
             out_packet_.at(out_packet_.size() - 2) = calcCRC16 & 0xFF;
 
+            // Stamp as late as possible so it is close to when the bytes actually go out
+            uint32_t now = micros();
+            if (timestamps_) {
+                out_packet_.at(5) = now >> 24;
+                out_packet_.at(6) = (now >> 16) & 0xFF;
+                out_packet_.at(7) = (now >> 8) & 0xFF;
+                out_packet_.at(8) = now & 0xFF;
+            }
+            if (ack_pending_) {
+                ack_histogram_.record(now - rx_us_);
+                ack_pending_ = false;
+            }
+
         #ifdef ARDUINO_STL_USE_VECTOR_BEGIN
             //serial_device_->write((const char *)out_packet_.begin(), out_packet_.size());
             for (int i= 0; i < out_packet_.size(); i++)
@@ -207,59 +412,189 @@ namespace rw {
         #endif
         }
 
-        void SerialDevicePeripheral::sendInfoPacket() {
-            clearData();
-            out_packet_.clear();
-            add("class", device_description_.class_id);
-            add("type", device_description_.type_id);
-            add("serial", device_description_.serial);
-            add("v1", device_description_.version_major);
-            add("v2", device_description_.version_minor);
-            add("v3", device_description_.version_revision);
-            add("name", device_description_.name);
-            add("info", device_description_.info);
-            uint16_t pSize = 0;
-            cmd_ = (uint8_t) SD_COMMAND_SEND_INFO;
-            out_packet_.push_back(header_byte_);
-            out_packet_.push_back(packet_id_);
-            out_packet_.push_back(0); // Place holder for packet size
-            out_packet_.push_back(0); // Place holder for packet size
-            out_packet_.push_back(cmd_);
-            pSize++;
-            pSize += serialize(out_packet_);
-            out_packet_.push_back(0); // Place holder for CRC-16
-            out_packet_.push_back(0); // Place holder for CRC-16
-            out_packet_.push_back(stop_byte_);
-            pSize += 3;
-            out_packet_.at(2) = pSize >> 8;
-            out_packet_.at(3) = pSize & 0xFF;
+        bool SerialDevicePeripheral::available() {
+            // The only place the data get() reads from changes, so a frame stays intact
+            // however many update() calls happen while the app is reading it
+            reader_active_ = true;
+            if (rx_pending_) {
+                swapData(rx_back_);
+                rx_pending_ = false;
+                frame_version_++;
+                data_available_ = true;
+                data_read_ = false;
+            }
+            return data_available_;
+        }
 
-            // Calculate and insert CRC16
-        #ifdef ARDUINO_STL_USE_VECTOR_BEGIN
-            uint16_t calcCRC16 = crc_.calculate((const unsigned char*)out_packet_.begin(), 5, out_packet_.size() - 3);
-        #else
-            uint16_t calcCRC16 = crc_.calculate((const unsigned char *) out_packet_.data(), 5, out_packet_.size() - 3);
-        #endif
-            out_packet_.at(out_packet_.size() - 3) = calcCRC16 >> 8;
-            out_packet_.at(out_packet_.size() - 2) = calcCRC16 & 0xFF;
+        uint32_t SerialDevicePeripheral::frameVersion() const {
+            return frame_version_;
+        }
 
-        #ifdef ARDUINO_STL_USE_VECTOR_BEGIN
-            //serial_device_->write((uint8_t*)out_packet_.begin(), out_packet_.size());
-            for (int i = 0; i < out_packet_.size(); i++)
-            {
-                uint8_t c = out_packet_[i];
-                //Serial.print((char)out_packet_.at(i));
-                Serial.write(&c, 1);
-                //delay(10);
-                //Serial.println(i);
+        uint32_t SerialDevicePeripheral::droppedPackets() const {
+            return dropped_packets_;
+        }
+
+        void SerialDevicePeripheral::enableTimestamps(bool enable) {
+            timestamps_ = enable;
+        }
+
+        bool SerialDevicePeripheral::timestampsEnabled() const {
+            return timestamps_;
+        }
+
+        const latencyHistogram &SerialDevicePeripheral::getPollHistogram() const {
+            return poll_histogram_;
+        }
+
+        const latencyHistogram &SerialDevicePeripheral::getAckHistogram() const {
+            return ack_histogram_;
+        }
+
+        void SerialDevicePeripheral::resetStats() {
+            poll_histogram_.reset();
+            ack_histogram_.reset();
+            polled_ = false;
+        }
+
+        bool SerialDevicePeripheral::onCommand(const char *key, const char *value, commandHandler handler, void *context) {
+            if (key == nullptr || value == nullptr || handler == nullptr)
+                return false;
+            dispatchEntry e{};
+            e.key = key;
+            e.key_size = stringSize(key);
+            e.key_hash = mdt::hashBytes((const uint8_t *) key, e.key_size);
+            e.value = value;
+            e.value_size = stringSize(value);
+            e.value_hash = mdt::hashBytes((const uint8_t *) value, e.value_size);
+            e.command = handler;
+            e.context = context;
+            dispatch_.insert(dispatch_.begin() + lowerBound(dispatch_, e.key_hash, e.value_hash), e);
+            return true;
+        }
+
+        bool SerialDevicePeripheral::onKey(const char *key, keyHandler handler, void *context) {
+            if (key == nullptr || handler == nullptr)
+                return false;
+            dispatchEntry e{};
+            e.key = key;
+            e.key_size = stringSize(key);
+            e.key_hash = mdt::hashBytes((const uint8_t *) key, e.key_size);
+            e.field = handler;
+            e.context = context;
+            dispatch_.insert(dispatch_.begin() + lowerBound(dispatch_, e.key_hash, 0), e);
+            return true;
+        }
+
+        bool SerialDevicePeripheral::dispatch(mdt::MixedDataType &frame) {
+            // One hash per field and a binary search, so the cost doesn't grow with the
+            // number of registered commands
+            bool handled = false;
+            for (size_t i = 0; i < frame.fieldCount(); i++) {
+                const mdt::dataStruct &d = frame.fieldAt(i);
+                const uint8_t *key = (const uint8_t *) d.key.c_str();
+                uint32_t keyHash = mdt::hashBytes(key, d.key.size());
+                mdt::fieldView value = mdt::MixedDataType::view(d);
+
+                for (size_t j = lowerBound(dispatch_, keyHash, 0);
+                     j < dispatch_.size() && dispatch_[j].key_hash == keyHash && dispatch_[j].value_hash == 0; j++) {
+                    const dispatchEntry &e = dispatch_[j];
+                    if (e.field != nullptr && sameBytes(e.key, e.key_size, key, d.key.size())) {
+                        e.field(*this, value, e.context);
+                        handled = true;
+                    }
+                }
+
+                if (d.data_type != mdt::DATA_TYPE_STRING)
+                    continue;
+                uint32_t valueHash = mdt::hashBytes(value.data, value.size);
+                for (size_t j = lowerBound(dispatch_, keyHash, valueHash);
+                     j < dispatch_.size() && dispatch_[j].key_hash == keyHash && dispatch_[j].value_hash == valueHash; j++) {
+                    const dispatchEntry &e = dispatch_[j];
+                    if (e.command != nullptr && sameBytes(e.key, e.key_size, key, d.key.size())
+                        && sameBytes(e.value, e.value_size, value.data, value.size)) {
+                        e.command(*this, frame, e.context);
+                        handled = true;
+                    }
+                }
             }
-        #else
-            serial_device_->write((uint8_t *) out_packet_.data(), out_packet_.size());
-        #endif
+            return handled;
         }
 
-        bool SerialDevicePeripheral::available() {
-            return data_available_;
+        void SerialDevicePeripheral::onStream(streamSink sink, void *context) {
+            stream_.setSink(sink, context);
+        }
+
+        kStreamStatus SerialDevicePeripheral::streamStatus() const {
+            return stream_.status();
+        }
+
+        bool SerialDevicePeripheral::sendStream(uint8_t streamId, uint32_t total, streamSource source, void *context, uint16_t chunkSize) {
+            if (source == nullptr || chunkSize == 0 || chunkSize > 0xFFFF - kStreamHeaderSize - 8)
+                return false;
+            if (stop_data_ && millis() - stop_timeout_ < 4000)
+                return false;
+
+            streamChunk chunk{};
+            chunk.stream_id = streamId;
+            chunk.total = total;
+            chunk.seq = stream_seq_++;
+            uint16_t crc = 0;
+            uint8_t retries = 0;
+            for (;;) {
+                uint16_t size = total - chunk.offset < chunkSize ? (uint16_t)(total - chunk.offset) : chunkSize;
+                beginPacket(SD_COMMAND_STREAM_CHUNK);
+                size_t header = out_packet_.size();
+                // The source writes straight into the outgoing packet, the object is never held in full
+                out_packet_.resize(header + kStreamHeaderSize + size);
+                uint8_t *data = &out_packet_[header + kStreamHeaderSize];
+                if (size > 0 && source(chunk.offset, data, size, context) != size)
+                    return false;
+                chunk.crc = crc_.calculate(data, 0, size, crc);
+                writeStreamHeader(&out_packet_[header], chunk);
+                stream_ack_valid_ = false;
+                endPacket();
+
+                streamAck ack;
+                if (!waitStreamAck(chunk, ack)) {
+                    if (++retries > kStreamRetries)
+                        return false;
+                    continue;
+                }
+                if (ack.status == SD_STREAM_ABORTED)
+                    return false;
+                if (ack.status != SD_STREAM_ERROR && ack.received == chunk.offset + size) {
+                    crc = chunk.crc;
+                    chunk.offset += size;
+                    chunk.seq = stream_seq_++;
+                    retries = 0;
+                    if (chunk.offset == total)
+                        return true;
+                }
+                // Only the chunk just sent can be repeated, the object isn't kept so there is
+                // no going back any further than that
+                else if (ack.received != chunk.offset || ++retries > kStreamRetries)
+                    return false;
+            }
+        }
+
+        bool SerialDevicePeripheral::waitStreamAck(const streamChunk &chunk, streamAck &ack) {
+            // Everything else the host sends in the meantime is handled as update() would
+            unsigned long start = millis();
+            while (millis() - start < kStreamAckTimeoutMs) {
+                // The ack can't wait behind packets the app isn't reading while we block
+                if (rx_stalled_)
+                    dropOldestData();
+                if (!serial_device_->available())
+                    continue;
+                if (!handleByte((uint8_t) serial_device_->read()) || !stream_ack_valid_)
+                    continue;
+                if (stream_ack_.stream_id == chunk.stream_id && stream_ack_.seq == chunk.seq) {
+                    ack = stream_ack_;
+                    return true;
+                }
+                stream_ack_valid_ = false;
+            }
+            return false;
         }
     }
 }
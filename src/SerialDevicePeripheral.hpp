@@ -20,6 +20,25 @@
 
 namespace rw {
     namespace serial_device {
+        class SerialDevicePeripheral;
+
+        // Called from update() when a data packet has a string field matching a registered key / value
+        typedef void (*commandHandler)(SerialDevicePeripheral &device, mdt::MixedDataType &frame, void *context);
+        // Called from update() for every data packet containing a registered key
+        typedef void (*keyHandler)(SerialDevicePeripheral &device, const mdt::fieldView &value, void *context);
+
+        typedef struct dispatchEntry {
+          uint32_t key_hash;
+          uint32_t value_hash;
+          const char *key;
+          const char *value;
+          uint8_t key_size;
+          uint8_t value_size;
+          commandHandler command;
+          keyHandler field;
+          void *context;
+        } dispatchEntry;
+
         class SerialDevicePeripheral : public mdt::MixedDataType {
          public:
           SerialDevicePeripheral(HardwareSerial *serial_device);
@@ -42,15 +61,57 @@ namespace rw {
           void update();
           void sendPacket(kSudCommandType cmd = SD_COMMAND_SEND_DATA);
           bool available();
+          uint32_t frameVersion() const;
+          // Data packets thrown away unread because the queue was full while sendStream() waited for an ack
+          uint32_t droppedPackets() const;
+          void enableTimestamps(bool enable);
+          bool timestampsEnabled() const;
+          const latencyHistogram &getPollHistogram() const;
+          const latencyHistogram &getAckHistogram() const;
+          void resetStats();
+          // Register once at setup, key / value must stay valid for the life of the device
+          // (string literals are fine). Packets that match a handler are not passed on to available()
+          bool onCommand(const char *key, const char *value, commandHandler handler, void *context = nullptr);
+          bool onKey(const char *key, keyHandler handler, void *context = nullptr);
+          // Chunks of incoming streams are passed to sink from update() as they arrive
+          void onStream(streamSink sink, void *context = nullptr);
+          kStreamStatus streamStatus() const;
+          // Blocks until the whole object has been sent and acked, pulling it from source a chunk at a time.
+          // Packets from the host are still handled while it waits for each ack, if data packets back
+          // up past the queue the oldest unread one is dropped (see droppedPackets())
+          bool sendStream(uint8_t streamId, uint32_t total, streamSource source, void *context = nullptr, uint16_t chunkSize = kStreamChunkSize);
 
          protected:
           void sendInfoPacket();
+          void sendPingReply();
+          void sendStatsPacket();
+          void sendStreamAck();
+          bool handleByte(uint8_t byte);
+          bool waitStreamAck(const streamChunk &chunk, streamAck &ack);
+          void beginPacket(uint8_t cmd);
+          void endPacket();
+          bool dispatch(mdt::MixedDataType &frame);
+          void receiveData(const std::vector<uint8_t> &payload);
+          void drainHeldData();
+          void dropOldestData();
 
          private:
           deviceDescriptor device_description_;
           HardwareSerial *serial_device_;
-          std::vector<uint8_t> in_packet_;
           std::vector<uint8_t> out_packet_;
+          mdt::DataPacket reply_;
+          mdt::DataPacket rx_back_;
+          bool rx_pending_;
+          bool reader_active_;
+          std::vector<uint8_t> rx_held_;
+          bool rx_held_valid_;
+          bool rx_stalled_;
+          uint32_t dropped_packets_;
+          streamAck stream_ack_;
+          uint16_t stream_seq_;
+          bool stream_ack_valid_;
+          uint32_t frame_version_;
+          std::vector<dispatchEntry> dispatch_;
           uint8_t header_byte_;
           uint8_t packet_id_;
           uint8_t stop_byte_;
@@ -59,7 +120,16 @@ namespace rw {
 		  bool data_error_;
 		  bool stop_data_;
 		  long stop_timeout_;
+          bool timestamps_;
+          bool polled_;
+          uint32_t last_poll_us_;
+          bool ack_pending_;
+          uint32_t rx_us_;
+          latencyHistogram poll_histogram_;
+          latencyHistogram ack_histogram_;
           CRC16 crc_;
+          PacketParser parser_;
+          StreamReceiver stream_;
         };
     } // End mdt namespace
 } // End rw namespace